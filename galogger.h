@@ -10,11 +10,19 @@
 
 #include <mutex>
 #include <unordered_map>
-#include <list>
+#include <vector>
 #include <thread>
 #include <memory>
-#include <iterator>
+#include <typeinfo>
+#include <random>
+#include <atomic>
+#include <algorithm>
+#include <string_view>
 #include <condition_variable>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "httpclient.h"
 
@@ -22,6 +30,18 @@
 #define PUSH_COUNT    size_t(20)
 #define BASE_GA_URL   "https://www.google-analytics.com/batch"
 
+#define GA_MAX_QUEUE     size_t(10000)             // Hits kept in memory
+#define GA_MAX_ATTEMPTS  5                         // Without spool, retries per hit
+#define GA_MAX_QT        (4*3600*1000ULL)          // GA drops hits older than 4h (ms)
+#define GA_SPOOL_AGE     std::chrono::seconds(60)  // Unsent hits older than this get spooled
+#define GA_SPOOL_BATCH   size_t(200)               // Hits replayed at once
+#define GA_BATCH_BYTES   size_t(16*1024)           // Endpoint limits: payload size
+#define GA_HIT_BYTES     size_t(8*1024)            // and single hit size
+#define GA_MAX_INFLIGHT  4                         // Concurrent batch requests
+#define GA_BACKOFF_BASE  std::chrono::milliseconds(500)
+#define GA_BACKOFF_MAX   std::chrono::milliseconds(5*60*1000)
+#define GA_AGG_SHARDS    16                        // Aggregation hash map shards
+
 // Event to push:
 // Exceptions have a type, to track errors reported to the user (or internal errors too).
 // Pageviews, which have location (dl), hostname (dh), path (dp), title (dt)
@@ -34,6 +54,7 @@ protected:
 
 	GAUpdate(uint64_t userid) : t(ptimems()), userid(userid), attempts(0) {}
 
+public:
 	static uint64_t ptimems() {
 		struct timespec spec;
 		clock_gettime(CLOCK_REALTIME, &spec);
@@ -43,7 +64,6 @@ protected:
 		return ret;
 	}
 
-public:
 	unsigned attempts;
 
 	void set_lang(const std::string &lang) {
@@ -52,6 +72,8 @@ public:
 
 	virtual ~GAUpdate() {}
 
+	uint64_t time() const { return t; }
+
 	virtual std::unordered_multimap<std::string, std::string> serialize() const {
 		return {
 			{"v",   "1"},
@@ -60,6 +82,44 @@ public:
 			{"ul",  lang},
 		};
 	}
+
+	// Appends the hit fields as "&key=value" (URL encoded) to out, except
+	// v/tid/qt which are added when the hit is sent. The default uses
+	// serialize(), so types that only implement that keep working.
+	virtual void serialize_to(std::string *out) const {
+		for (const auto & it : serialize())
+			if (it.first != "v" && it.first != "qt" && it.first != "tid")
+				append_field(out, it.first, it.second);
+	}
+
+	// Inline URL encoder (same unreserved set as curl_escape)
+	static void urlenc(std::string *out, std::string_view s) {
+		static const char hexd[] = "0123456789ABCDEF";
+		for (unsigned char c : s) {
+			if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+			    c == '-' || c == '.' || c == '_' || c == '~')
+				*out += c;
+			else {
+				char e[3] = {'%', hexd[c >> 4], hexd[c & 15]};
+				out->append(e, 3);
+			}
+		}
+	}
+
+	static void append_field(std::string *out, std::string_view key, std::string_view value) {
+		*out += '&';
+		*out += key;
+		*out += '=';
+		urlenc(out, value);
+	}
+
+protected:
+	// Fast path for the base fields
+	void serialize_base(std::string *out) const {
+		*out += "&cid=";
+		*out += std::to_string(userid);
+		append_field(out, "ul", lang);
+	}
 };
 
 class GAPageView : public GAUpdate {
@@ -77,28 +137,387 @@ public:
 		ret.emplace("dp", dp);
 		return ret;
 	}
+
+	void serialize_to(std::string *out) const {
+		// Subclasses that only override serialize() use the generic path
+		if (typeid(*this) != typeid(GAPageView))
+			return GAUpdate::serialize_to(out);
+		serialize_base(out);
+		*out += "&t=pageview";
+		append_field(out, "dt", dt);
+		append_field(out, "dh", dh);
+		append_field(out, "dp", dp);
+	}
 };
 
 class GAEvent : public GAUpdate {
 protected:
-	std::string ecat, eaction;
+	std::string ecat, eaction, elabel;
+	int64_t evalue;       // Negative if not set
 public:
-	GAEvent(uint64_t userid, std::string category, std::string action)
-	 : GAUpdate(userid), ecat(category), eaction(action) { }
+	GAEvent(uint64_t userid, std::string category, std::string action,
+	        std::string label = "", int64_t value = -1)
+	 : GAUpdate(userid), ecat(category), eaction(action), elabel(label), evalue(value) { }
+
+	const std::string &category() const { return ecat; }
+	const std::string &action() const { return eaction; }
+	const std::string &label() const { return elabel; }
+	int64_t value() const { return evalue; }
+	uint64_t user() const { return userid; }
 
 	std::unordered_multimap<std::string, std::string> serialize() const {
 		auto ret = GAUpdate::serialize();
 		ret.emplace("t", "event");
 		ret.emplace("ec", ecat);
 		ret.emplace("ea", eaction);
+		if (!elabel.empty())
+			ret.emplace("el", elabel);
+		if (evalue >= 0)
+			ret.emplace("ev", std::to_string(evalue));
 		return ret;
 	}
+
+	void serialize_to(std::string *out) const {
+		// Subclasses that only override serialize() use the generic path
+		if (typeid(*this) != typeid(GAEvent))
+			return GAUpdate::serialize_to(out);
+		serialize_base(out);
+		*out += "&t=event";
+		append_field(out, "ec", ecat);
+		append_field(out, "ea", eaction);
+		if (!elabel.empty())
+			append_field(out, "el", elabel);
+		if (evalue >= 0) {
+			*out += "&ev=";
+			*out += std::to_string(evalue);
+		}
+	}
+};
+
+// Queue of serialized hits, kept in two flat buffers (hit headers and hit
+// fields) that are consumed from the front and compacted once in a while.
+class GAHitQueue {
+public:
+	struct t_hit {
+		uint64_t t;          // Time the event happened (ms), for qt
+		unsigned attempts;   // Failed pushes so far
+		uint32_t len;        // Length of its fields
+		bool replayed;       // Read back from the spool
+	};
+
+	size_t size() const { return hits.size() - hhead; }
+	bool empty() const { return size() == 0; }
+	const t_hit &front() const { return hits[hhead]; }
+
+	void push(uint64_t t, unsigned attempts, std::string_view fields, bool replayed = false) {
+		hits.push_back({t, attempts, (uint32_t)fields.size(), replayed});
+		data.append(fields.data(), fields.size());
+	}
+
+	// Bytes held by the queued hits fields
+	size_t bytes() const { return data.size() - dhead; }
+
+	// Moves up to n hits (from the front) to another queue
+	void pop(size_t n, GAHitQueue *out) {
+		pop(n, ~size_t(0), 0, out);
+	}
+
+	// Same, limited to maxbytes (counting overhead bytes per hit) but always
+	// moving at least one hit
+	void pop(size_t n, size_t maxbytes, size_t overhead, GAHitQueue *out) {
+		n = std::min(n, size());
+		size_t len = 0, i = hhead;
+		for (size_t total = 0; i < hhead + n; i++) {
+			total += hits[i].len + overhead;
+			if (total > maxbytes && i > hhead)
+				break;
+			out->hits.push_back(hits[i]);
+			len += hits[i].len;
+		}
+		n = i - hhead;
+		out->data.append(data, dhead, len);
+		hhead += n;
+		dhead += len;
+
+		if (hhead == hits.size()) {
+			hits.clear();
+			data.clear();
+			hhead = dhead = 0;
+		}
+		else if (hhead > hits.size() / 2) {
+			hits.erase(hits.begin(), hits.begin() + hhead);
+			data.erase(0, dhead);
+			hhead = dhead = 0;
+		}
+	}
+
+	// Iterates hits in order: cb(const t_hit&, std::string_view fields)
+	template<typename F>
+	void foreach(F cb) const {
+		size_t off = dhead;
+		for (size_t i = hhead; i < hits.size(); i++) {
+			cb(hits[i], std::string_view(data).substr(off, hits[i].len));
+			off += hits[i].len;
+		}
+	}
+
+	void clear() {
+		hits.clear();
+		data.clear();
+		hhead = dhead = 0;
+	}
+
+	void swap(GAHitQueue &o) {
+		hits.swap(o.hits);
+		data.swap(o.data);
+		std::swap(hhead, o.hhead);
+		std::swap(dhead, o.dhead);
+	}
+
+private:
+	std::vector<t_hit> hits;
+	std::string data;
+	size_t hhead = 0, dhead = 0;
+};
+
+// Append-only file of hits that could not be delivered (in time). Records
+// are "time attempts fields" lines. They are replayed from a read offset
+// (persisted in a .pos file), the file is truncated once fully replayed.
+// It does blocking I/O, callers should not hold any hot lock.
+class GASpool {
+public:
+	GASpool(std::string fn) {
+		if (fn.empty())
+			return;
+		fd = open(fn.c_str(), O_RDWR | O_APPEND | O_CREAT, S_IRUSR | S_IWUSR);
+		posfd = open((fn + ".pos").c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+		char buf[32] = {0};
+		if (posfd >= 0 && pread(posfd, buf, sizeof(buf) - 1, 0) > 0)
+			rdoff = strtoull(buf, NULL, 10);
+		if (fd >= 0)
+			wroff = lseek(fd, 0, SEEK_END);
+		if (rdoff > wroff)
+			rdoff = 0;
+	}
+
+	~GASpool() {
+		if (fd >= 0)
+			close(fd);
+		if (posfd >= 0)
+			close(posfd);
+	}
+
+	bool enabled() const { return fd >= 0; }
+
+	bool empty() const {
+		std::lock_guard<std::mutex> guard(mu);
+		return rdoff == wroff;
+	}
+
+	// Appends hits, returns false if they could not be written
+	bool append(const GAHitQueue &hits) {
+		std::string buf;
+		hits.foreach([&buf] (const GAHitQueue::t_hit &h, std::string_view fields) {
+			buf += std::to_string(h.t) + " " + std::to_string(h.attempts) + " ";
+			buf += fields;
+			buf += '\n';
+		});
+
+		std::lock_guard<std::mutex> guard(mu);
+		ssize_t w = write(fd, buf.data(), buf.size());
+		if (w == (ssize_t)buf.size()) {
+			wroff += w;
+			return true;
+		}
+		// Do not leave a partial record behind (or at least end its line,
+		// so it does not merge with the next one)
+		if (w > 0) {
+			if (!ftruncate(fd, wroff))
+				return false;
+			if (write(fd, "\n", 1) == 1)
+				w++;
+			wroff += w;
+		}
+		return false;
+	}
+
+	// Reads up to n hits into out, skipping the ones older than mint.
+	// Returns the number of records consumed.
+	size_t replay(size_t n, uint64_t mint, GAHitQueue *out) {
+		std::lock_guard<std::mutex> guard(mu);
+		size_t count = 0;
+		char buf[64*1024];
+		while (count < n && rdoff < wroff) {
+			ssize_t r = pread(fd, buf, std::min(sizeof(buf), (size_t)(wroff - rdoff)), rdoff);
+			if (r <= 0)
+				break;
+			std::string_view data(buf, r);
+			size_t p = 0;
+			for (size_t nl; count < n && (nl = data.find('\n', p)) != std::string_view::npos; p = nl + 1) {
+				std::string_view line = data.substr(p, nl - p);
+				unsigned long long t;
+				unsigned attempts;
+				int hdr;
+				std::string tmp(line.substr(0, 64));
+				if (sscanf(tmp.c_str(), "%llu %u %n", &t, &attempts, &hdr) == 2 && t >= mint)
+					out->push(t, attempts, line.substr(hdr), true);
+				count++;
+			}
+			if (!p && r == sizeof(buf))
+				p = r;   // Skip (corrupt) lines that do not fit the buffer
+			else if (!p)
+				break;   // Incomplete write, wait for it
+			rdoff += p;
+		}
+
+		if (rdoff == wroff && rdoff) {
+			if (!ftruncate(fd, 0))
+				rdoff = wroff = 0;
+		}
+		savepos();
+		return count;
+	}
+
+private:
+	// Fixed width, so it can be overwritten in place
+	void savepos() {
+		char buf[32];
+		int n = snprintf(buf, sizeof(buf), "%020llu\n", (unsigned long long)rdoff);
+		if (posfd >= 0 && pwrite(posfd, buf, n, 0) != n)
+			return;   // Worst case some hits are replayed twice
+	}
+
+	int fd = -1, posfd = -1;
+	uint64_t rdoff = 0, wroff = 0;
+	mutable std::mutex mu;
+};
+
+// Counts identical (category, action, label) events, in a sharded hash
+// map so concurrent producers rarely contend. take() empties it.
+class GAAggregator {
+public:
+	struct t_count {
+		uint64_t count;      // Sum of the event values (1 if not set)
+		uint64_t userid;     // First user seen, GA needs a client id
+		uint64_t t;          // First time seen
+	};
+
+	void add(uint64_t userid, std::string_view cat, std::string_view action,
+	         std::string_view label, uint64_t value) {
+		static thread_local std::string key;
+		key.clear();
+		key.append(cat.data(), cat.size());
+		key += '\0';
+		key.append(action.data(), action.size());
+		key += '\0';
+		key.append(label.data(), label.size());
+
+		t_shard &s = shards[std::hash<std::string>()(key) % GA_AGG_SHARDS];
+		std::lock_guard<std::mutex> guard(s.mu);
+		auto it = s.counts.find(key);
+		if (it != s.counts.end())
+			it->second.count += value;
+		else
+			s.counts.emplace(key, t_count{value, userid, GAUpdate::ptimems()});
+	}
+
+	// Calls cb(category, action, label, t_count) for every tuple and clears them
+	template<typename F>
+	void take(F cb) {
+		std::unordered_map<std::string, t_count> tmp;
+		for (auto & s : shards) {
+			{
+				std::lock_guard<std::mutex> guard(s.mu);
+				tmp.swap(s.counts);
+			}
+			for (const auto & it : tmp) {
+				std::string_view k(it.first);
+				size_t p1 = k.find('\0'), p2 = k.find('\0', p1 + 1);
+				cb(k.substr(0, p1), k.substr(p1 + 1, p2 - p1 - 1), k.substr(p2 + 1), it.second);
+			}
+			tmp.clear();
+		}
+	}
+
+private:
+	struct t_shard {
+		std::mutex mu;
+		std::unordered_map<std::string, t_count> counts;
+	};
+	t_shard shards[GA_AGG_SHARDS];
+};
+
+// Exponential backoff for failed requests: base * 2^(failures - 1), up to
+// max, randomly reduced by up to a half so retries do not synchronize
+class GABackoff {
+public:
+	GABackoff(std::chrono::milliseconds base, std::chrono::milliseconds max)
+	 : base(base.count()), max(max.count()), rnd(std::random_device()()) {}
+
+	// Registers a failure, returns the delay before the next attempt (ms)
+	uint64_t failed() {
+		streak++;
+		uint64_t delay = std::min<uint64_t>(max, base << std::min(streak - 1, 20U));
+		return delay - std::uniform_int_distribution<uint64_t>(0, delay / 2)(rnd);
+	}
+
+	void succeeded() { streak = 0; }
+	unsigned failures() const { return streak; }
+
+private:
+	uint64_t base, max;
+	unsigned streak = 0;
+	std::minstd_rand rnd;
+};
+
+struct GAOptions {
+	std::string url = BASE_GA_URL;            // Batch endpoint
+	std::string spoolfile;                    // Empty disables the spool
+	size_t maxqueue = GA_MAX_QUEUE;           // Hits kept in memory
+	std::chrono::seconds spoolage = GA_SPOOL_AGE;
+
+	// A batch is sent once it is full (batchhits or batchbytes) or its
+	// oldest hit waited for maxdelay, with up to maxinflight at once.
+	size_t batchhits = PUSH_COUNT;
+	size_t batchbytes = GA_BATCH_BYTES;
+	std::chrono::milliseconds maxdelay = PUSH_TIMEOUT;
+	unsigned maxinflight = GA_MAX_INFLIGHT;
+	// Failures delay the next push by base * 2^failures (up to max), with
+	// a random jitter of up to half of it.
+	std::chrono::milliseconds backoffbase = GA_BACKOFF_BASE;
+	std::chrono::milliseconds backoffmax = GA_BACKOFF_MAX;
+
+	// If set, GAEvents (and count_event() calls) are counted per
+	// (category, action, label) and sent once per window as a single event
+	// whose value is the count (or the sum of their values).
+	std::chrono::milliseconds aggwindow{0};
+};
+
+struct GAStats {
+	uint64_t queued = 0;        // Hits pushed
+	uint64_t sent = 0;          // Hits delivered
+	uint64_t dropped = 0;       // Hits given up on (too big, too many attempts, full)
+	uint64_t retried = 0;       // Hits that failed and will be retried
+	uint64_t spooled = 0;       // Hits written to the spool
+	uint64_t replayed = 0;      // Hits read back from the spool
+	uint64_t aggregated = 0;    // Events counted by the aggregation stage
+	uint64_t aggflushed = 0;    // Hits generated from aggregated counts
+	uint64_t batches = 0;       // Requests that succeeded
+	uint64_t batchfails = 0;    // Requests that failed
+	uint64_t bytes = 0;         // Payload bytes delivered
+	size_t queuesize = 0;       // Hits currently in memory
+	unsigned inflight = 0;      // Requests currently in flight
+	unsigned failstreak = 0;    // Consecutive failed requests
 };
 
 class GoogleAnalyticsLogger {
 public:
-	GoogleAnalyticsLogger(std::string trackingid)
-	 : trackingid(trackingid), successful_hits(0), failed_hits(0) {
+	GoogleAnalyticsLogger(std::string trackingid, GAOptions opts = GAOptions())
+	 : trackingid(trackingid), opts(opts), spool(opts.spoolfile),
+	   backoff(opts.backoffbase, opts.backoffmax) {
+		GAUpdate::urlenc(&tidfield, trackingid);
+		// Per hit bytes added to its fields when sent (v, tid, qt, newline)
+		overhead = tidfield.size() + 32;
 		// Spawn a thread to push events, hopefully enough
 		writerth = std::thread(&GoogleAnalyticsLogger::pusher_thread, this);
 	}
@@ -106,108 +525,328 @@ public:
 	~GoogleAnalyticsLogger() {
 		// Set end and wake flush thread
 		{
-			std::unique_lock<std::mutex> lock(waitmu);
+			std::unique_lock<std::mutex> lock(mu);
 			end = true;
 		}
 		waitcond.notify_all();
 
 		// Wait for thread
 		writerth.join();
+
+		// Keep whatever is left (including batches in flight, which might
+		// be delivered twice) for the next run
+		if (spool.enabled()) {
+			GAHitQueue out;
+			{
+				std::lock_guard<std::mutex> guard(mu);
+				closing = true;
+				if (opts.aggwindow.count())
+					flush_aggregated();
+				for (auto & b : sending)
+					b->pop(b->size(), &tospool);
+				sending.clear();
+				event_queue.pop(event_queue.size(), &tospool);
+				out.swap(tospool);
+			}
+			spool.append(out);
+		}
 	}
 
+	// Takes ownership of the event (kept for compatibility)
 	void push_event(GAUpdate *event) {
-		// Add line to memory buffer
-		std::lock_guard<std::mutex> guard(mu);
-		event_queue.emplace_back(event);
+		std::unique_ptr<GAUpdate> ev(event);
+		push_event(*ev);
+	}
 
-		// Tell flusher to flush this (lazily)
-		waitcond.notify_all();
+	// Counts an event occurrence (see GAOptions::aggwindow), sent right
+	// away as a GAEvent if aggregation is disabled
+	void count_event(uint64_t userid, std::string_view category, std::string_view action,
+	                 std::string_view label = {}, uint64_t value = 1) {
+		if (!opts.aggwindow.count()) {
+			push_event(GAEvent(userid, std::string(category), std::string(action),
+			                   std::string(label), value));
+			return;
+		}
+		aggregator.add(userid, category, action, label, value);
+		aggregated.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// Events are serialized right away, no need to allocate them
+	void push_event(const GAUpdate &event) {
+		if (opts.aggwindow.count() && typeid(event) == typeid(GAEvent)) {
+			const GAEvent &ev = static_cast<const GAEvent&>(event);
+			count_event(ev.user(), ev.category(), ev.action(), ev.label(),
+			            ev.value() >= 0 ? ev.value() : 1);
+			return;
+		}
+
+		static thread_local std::string fields;
+		fields.clear();
+		event.serialize_to(&fields);
+
+		bool wake;
+		{
+			std::lock_guard<std::mutex> guard(mu);
+			stats.queued++;
+			if (fields.size() + overhead > GA_HIT_BYTES ||
+			    (event_queue.size() >= opts.maxqueue && !spool.enabled())) {
+				stats.dropped++;   // Too big or full, drop it
+				return;
+			}
+			event_queue.push(event.time(), 0, fields);
+			// Move the oldest hits to disk to keep memory bounded
+			bool spilled = event_queue.size() > opts.maxqueue;
+			if (spilled)
+				spill(event_queue.size() - opts.maxqueue / 2);
+			wake = spilled || batchready() || event_queue.size() == 1;
+		}
+
+		// Tell flusher to push a full batch (or about the new deadline)
+		if (wake)
+			waitcond.notify_all();
 	}
 
 	unsigned getSuccessfulHits() const {
 		std::lock_guard<std::mutex> guard(this->mu);
-		return successful_hits;
+		return stats.sent;
 	}
 
 	unsigned getFailedHits() const {
 		std::lock_guard<std::mutex> guard(this->mu);
-		return failed_hits;
+		return stats.dropped;
+	}
+
+	GAStats getStats() const {
+		std::lock_guard<std::mutex> guard(this->mu);
+		GAStats ret = stats;
+		ret.aggregated = aggregated.load(std::memory_order_relaxed);
+		ret.queuesize = event_queue.size();
+		ret.inflight = inflight;
+		ret.failstreak = backoff.failures();
+		return ret;
 	}
 
 private:
 
-	std::string serialize_hit(std::unordered_multimap<std::string, std::string> args) {
-		std::string ret;
-		for (auto it : args)
-			ret += it.first + "=" + HttpClient::urlescape(it.second) + "&";
-		ret.pop_back();
-		return ret;
+	// Whether a full batch is queued (holding mu)
+	bool batchready() const {
+		return event_queue.size() >= opts.batchhits ||
+		       event_queue.bytes() + event_queue.size() * overhead >= opts.batchbytes;
+	}
+
+	// Moves the n oldest hits to the spool (holding mu), the pusher thread
+	// writes them out
+	void spill(size_t n) {
+		event_queue.pop(n, &tospool);
+	}
+
+	// Moves hits that missed their deadline (the oldest ones) to the spool.
+	// Replayed hits are old by definition, they get their chance first.
+	void spool_stale(uint64_t now) {
+		uint64_t maxage = std::chrono::duration_cast<std::chrono::milliseconds>(opts.spoolage).count();
+		size_t stale = 0;
+		bool older = true;
+		event_queue.foreach([&] (const GAHitQueue::t_hit &h, std::string_view) {
+			older = older && !h.replayed && h.t + maxage < now;
+			stale += older;
+		});
+		if (stale)
+			spill(stale);
+	}
+
+	// Writes spilled hits and loads spooled hits back once delivery works
+	// and the queue is drained. While failing, once the backoff is over and
+	// nothing else is queued or in flight, a replayed batch is the probe.
+	// Called holding mu, released during the I/O.
+	void spool_io(std::unique_lock<std::mutex> &lock, uint64_t now) {
+		GAHitQueue out, in;
+		out.swap(tospool);
+		bool probe = now >= retryat && !inflight && event_queue.empty();
+		bool replay = (!backoff.failures() || probe) && event_queue.size() < opts.batchhits && !spool.empty();
+		if (out.empty() && !replay)
+			return;
+
+		lock.unlock();
+		bool ok = out.empty() || spool.append(out);
+		if (replay)
+			spool.replay(GA_SPOOL_BATCH, now > GA_MAX_QT ? now - GA_MAX_QT : 0, &in);
+		lock.lock();
+
+		if (ok)
+			stats.spooled += out.size();
+		else
+			stats.dropped += out.size();
+		stats.replayed += in.size();
+		in.pop(in.size(), &event_queue);
+	}
+
+	// Turns the counts of the last window into value-weighted events (holding mu)
+	void flush_aggregated() {
+		std::string fields;
+		aggregator.take([&] (std::string_view cat, std::string_view action,
+		                     std::string_view label, const GAAggregator::t_count &c) {
+			fields.clear();
+			GAEvent(c.userid, std::string(cat), std::string(action), std::string(label),
+			        c.count).serialize_to(&fields);
+			event_queue.push(c.t, 0, fields);
+			stats.aggflushed++;
+		});
+		if (event_queue.size() > opts.maxqueue) {
+			if (spool.enabled())
+				spill(event_queue.size() - opts.maxqueue / 2);
+			else {
+				GAHitQueue tmp;
+				stats.dropped += event_queue.size() - opts.maxqueue;
+				event_queue.pop(event_queue.size() - opts.maxqueue, &tmp);
+			}
+		}
+	}
+
+	// Builds the batch POST body: one hit per line
+	void serialize_batch(const GAHitQueue &hits, std::string *payload) const {
+		uint64_t now = GAUpdate::ptimems();
+		hits.foreach([&] (const GAHitQueue::t_hit &h, std::string_view fields) {
+			*payload += "v=1&tid=";
+			*payload += tidfield;
+			*payload += "&qt=";
+			*payload += std::to_string(now > h.t ? now - h.t : 0);
+			*payload += fields;
+			*payload += '\n';
+		});
+	}
+
+	// Called when a batch request finishes (holding mu)
+	void batchdone(bool ok, const GAHitQueue &upd, size_t bytes) {
+		inflight--;
+		if (closing)
+			return;   // Already spooled by the destructor
+		sending.erase(std::find_if(sending.begin(), sending.end(),
+			[&upd] (const std::shared_ptr<GAHitQueue> &b) { return b.get() == &upd; }));
+		if (ok) {
+			stats.sent += upd.size();
+			stats.batches++;
+			stats.bytes += bytes;
+			backoff.succeeded();
+			retryat = 0;
+			return;
+		}
+
+		stats.batchfails++;
+		retryat = std::max(retryat, GAUpdate::ptimems() + backoff.failed());
+
+		if (spool.enabled()) {
+			// Will be replayed once the endpoint is back
+			GAHitQueue tmp(upd);
+			tmp.pop(tmp.size(), &tospool);
+			return;
+		}
+		upd.foreach([this] (const GAHitQueue::t_hit &h, std::string_view fields) {
+			if (h.attempts >= GA_MAX_ATTEMPTS || event_queue.size() >= opts.maxqueue)
+				stats.dropped++;    // Just drop it!
+			else {
+				// Failed! Retry (after the backoff)
+				stats.retried++;
+				event_queue.push(h.t, h.attempts + 1, fields);
+			}
+		});
 	}
 
 	void pusher_thread() {
 		// Keeps pushing data to the GA frontend as long as there's some in the queue
+		std::string payload;
+		uint64_t lastspool = 0;
+		uint64_t aggnext = GAUpdate::ptimems() + opts.aggwindow.count();
+		std::unique_lock<std::mutex> lock(mu);
 		while (!end) {
-			std::unique_lock<std::mutex> lock(waitmu);
-			bool tout = std::cv_status::timeout == waitcond.wait_until(
-				lock, std::chrono::system_clock::now() + PUSH_TIMEOUT);
-
-			std::list<std::shared_ptr<GAUpdate>> upd;
-			do {
-				upd.clear();
-				{
-					std::lock_guard<std::mutex> guard(mu);
-					if (event_queue.size() > PUSH_COUNT || tout) {
-						// Extract up to PUSH_COUNT elements to be pushed
-						upd.splice(upd.begin(), event_queue, event_queue.begin(),
-							std::next(event_queue.begin(), std::min(PUSH_COUNT, event_queue.size())));
-					}
+			uint64_t now = GAUpdate::ptimems();
+			if (opts.aggwindow.count() && now >= aggnext) {
+				flush_aggregated();
+				aggnext = now + opts.aggwindow.count();
+			}
+			if (spool.enabled()) {
+				if (now >= lastspool + std::chrono::duration_cast<std::chrono::milliseconds>(PUSH_TIMEOUT).count()) {
+					spool_stale(now);
+					lastspool = now;
 				}
-
-				if (!upd.empty()) {
-					// Push via batch POST request
-					std::string payload;
-					for (auto hit : upd) {
-						auto args = hit->serialize();
-						args.emplace("tid", trackingid);
-						payload += serialize_hit(args) + "\n";
+				spool_io(lock, now);
+				if (end)
+					break;
+			}
+
+			// Send a batch if full or old enough, unless backing off or
+			// already at the in flight limit
+			uint64_t wakeat = now + std::chrono::duration_cast<std::chrono::milliseconds>(PUSH_TIMEOUT).count();
+			if (opts.aggwindow.count())
+				wakeat = std::min(wakeat, aggnext);
+			bool due = !event_queue.empty() &&
+				(batchready() || event_queue.front().t + opts.maxdelay.count() <= now);
+			if (!event_queue.empty() && !due)
+				wakeat = std::min(wakeat, event_queue.front().t + opts.maxdelay.count());
+			if (now < retryat) {
+				due = false;
+				wakeat = std::min(wakeat, retryat);
+			}
+			if (inflight >= opts.maxinflight)
+				due = false;   // Woken up by batchdone()
+
+			if (!due) {
+				waitcond.wait_until(lock, std::chrono::system_clock::time_point(
+					std::chrono::milliseconds(std::max(wakeat, now + 1))));
+				continue;
+			}
+
+			auto upd = std::make_shared<GAHitQueue>();
+			event_queue.pop(opts.batchhits, opts.batchbytes, overhead, upd.get());
+			sending.push_back(upd);
+			inflight++;
+			lock.unlock();
+
+			// Push via batch POST request, reusing the buffer capacity
+			payload.clear();
+			serialize_batch(*upd, &payload);
+			std::string body(std::move(payload));
+			payload.reserve(body.size());
+			size_t bytes = body.size();
+			client.doPOST(opts.url, std::move(body), nullptr,
+				[upd, bytes, this] (bool ok) {
+					{
+						std::lock_guard<std::mutex> guard(this->mu);
+						batchdone(ok, *upd, bytes);
 					}
-					client.doPOST(BASE_GA_URL, payload, nullptr,
-						[upd, this] (bool ok) mutable {
-							std::lock_guard<std::mutex> guard(this->mu);
-							if (ok)
-								successful_hits++;
-							else {
-								for (auto elem : upd) {
-									if (elem->attempts >= 5)
-										failed_hits++;    // Just drop it!
-									else {
-										// Failed! Let's retry, to simplify things just add to queue again
-										elem->attempts++;
-										this->event_queue.push_back(elem);
-									}
-								}
-							}
-						}
-					);
+					waitcond.notify_all();
 				}
-			} while (!upd.empty() && !end);
+			);
+			lock.lock();
 		}
 	}
 
-	std::string trackingid;
-	unsigned successful_hits, failed_hits;
-
-	// Mutex protected queue and http client
-	std::list<std::shared_ptr<GAUpdate>> event_queue;
-	HttpClient client;
+	std::string trackingid, tidfield;
+	size_t overhead;
+	GAOptions opts;
+	GASpool spool;
+
+	// Mutex protected queue, counters and push state
+	GAHitQueue event_queue;
+	GAHitQueue tospool;        // Waiting to be written to the spool
+	std::vector<std::shared_ptr<GAHitQueue>> sending;   // Batches in flight
+	bool closing = false;
+	GAStats stats;
+	unsigned inflight = 0;
+	uint64_t retryat = 0;      // Backing off until then (ms)
+	GABackoff backoff;
 	mutable std::mutex mu;
 
+	// Aggregation stage, has its own locking
+	GAAggregator aggregator;
+	std::atomic<uint64_t> aggregated{0};
+
 	// Thread that sits in the background flushing stuff
 	std::thread writerth;
-	mutable std::mutex waitmu;
 	std::condition_variable waitcond;
 	bool end = false;
+
+	// Goes first, might still run callbacks
+	HttpClient client;
 };
 
 #endif
-
@@ -8,6 +8,7 @@
 
 #include <memory>
 #include <unordered_map>
+#include <map>
 #include <mutex>
 #include <vector>
 #include <thread>
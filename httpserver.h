@@ -2,19 +2,47 @@
 // Created by David Guillen Fandos <david@davidgf.net> 2021
 
 // Super-thin wrapper around microhttpd library
-// Mainly single-threaded.
+// Single-threaded by default, can use a thread pool and epoll.
 
 #include <string>
 #include <unordered_map>
 #include <mutex>
+#include <atomic>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
 #include <functional>
+#include <deque>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <memory>
 #include <microhttpd.h>
 #include <iostream>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
 
 #if MHD_VERSION < 0x00097002
 #define MHD_Result int
 #endif
 
+#define HTTP_POOL_SIZE       1024          // Request objects kept for reuse
+#define HTTP_POOL_BODY_CAP   (64*1024)     // Max body capacity kept by pooled objects
+#define HTTP_PENDING_SHARDS  16            // Shards for requests waiting for respond()
+#define HTTP_STREAM_BLOCK    (32*1024)     // Block size for streamed responses
+#define HTTP_WHEEL_SLOTS     256           // Reaper timer wheel slots per shard
+#define HTTP_WHEEL_TICK_MS   100           // Reaper timer wheel resolution
+#define HTTP_REAPED_GRACE    600           // Seconds reaped requests are kept out of the pool
+#define HTTP_METRIC_STRIPES  8             // Per-thread counter stripes per route
+#define HTTP_HIST_BUCKETS    104           // Log-linear latency buckets (4 per power of 2, us)
+#define HTTP_WEBHOOK_DEDUP   4096          // update_id window remembered by webhook mode
+#define HTTP_WEBHOOK_MAXBODY (1024*1024)   // Default webhook update size limit
+#define HTTP_WEBHOOK_SECRET  "X-Telegram-Bot-Api-Secret-Token"
+
+class HTTPServer;
+
 class HTTPReq {
 public:
 	HTTPReq(std::string method, std::string url)
@@ -23,93 +51,819 @@ public:
 	std::string url;
 	std::string body;
 	bool truncated;
+
+	// Headers and query arguments, looked up on demand (NULL if missing).
+	// Only valid until the request is responded to.
+	const char *header(const char *name) const {
+		return MHD_lookup_connection_value(conn, MHD_HEADER_KIND, name);
+	}
+	const char *arg(const char *name) const {
+		return MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, name);
+	}
+
+	// Free for handlers to use (ie. streaming parser state)
+	mutable void *userptr = NULL;
+
+private:
+	friend class HTTPServer;
+	enum State { Receiving, Pending, Done, Aborted, Reaped };
+
+	// Connection and state (the request is the handle to respond)
+	struct MHD_Connection *conn = NULL;
+	State state = Receiving;
+	// Pending timer wheel slot list (intrusive, see HTTPServer::pending)
+	uint64_t deadline = 0;
+	HTTPReq *prev = NULL, *next = NULL;
+	// Metrics: route, bytes received and timestamps (first callback, user callback)
+	unsigned route = 0;
+	uint64_t inbytes = 0, tstart = 0, tcb = 0;
 };
 
 class HTTPResp {
 public:
+	// Reads up to max bytes at pos, returns the amount written or
+	// MHD_CONTENT_READER_END_OF_STREAM / MHD_CONTENT_READER_END_WITH_ERROR
+	typedef std::function<ssize_t(uint64_t pos, char *buf, size_t max)> t_reader;
+
 	HTTPResp(unsigned status, std::string content_type, std::string data)
-		:status(status), content_type(content_type), data(data) {}
+		:status(status), content_type(std::move(content_type)), data(std::move(data)) {}
+
+	// Serves size bytes from fd at offset (sendfile when possible).
+	// The response owns the fd and closes it.
+	static HTTPResp file(unsigned status, std::string content_type, int fd, uint64_t offset, uint64_t size) {
+		HTTPResp r(status, std::move(content_type), "");
+		r.fd = fd;
+		r.offset = offset;
+		r.size = size;
+		return r;
+	}
+
+	// Streams the body from a callback, size can be MHD_SIZE_UNKNOWN (chunked)
+	static HTTPResp stream(unsigned status, std::string content_type, t_reader reader,
+	                       uint64_t size = MHD_SIZE_UNKNOWN) {
+		HTTPResp r(status, std::move(content_type), "");
+		r.reader = std::move(reader);
+		r.size = size;
+		return r;
+	}
+
+	HTTPResp(HTTPResp &&o)
+		:status(o.status), content_type(std::move(o.content_type)), data(std::move(o.data)),
+		 headers(std::move(o.headers)), fd(o.fd), offset(o.offset), size(o.size),
+		 reader(std::move(o.reader)) { o.fd = -1; }
+	// Copies get their own fd
+	HTTPResp(const HTTPResp &o)
+		:status(o.status), content_type(o.content_type), data(o.data),
+		 headers(o.headers), fd(o.fd >= 0 ? dup(o.fd) : -1), offset(o.offset), size(o.size),
+		 reader(o.reader) {}
+	HTTPResp &operator=(HTTPResp o) {
+		std::swap(status, o.status);
+		std::swap(content_type, o.content_type);
+		std::swap(data, o.data);
+		std::swap(headers, o.headers);
+		std::swap(fd, o.fd);
+		std::swap(offset, o.offset);
+		std::swap(size, o.size);
+		std::swap(reader, o.reader);
+		return *this;
+	}
+	~HTTPResp() {
+		if (fd >= 0)
+			close(fd);
+	}
+
 	unsigned status;
 	std::string content_type;
 	std::string data;
+	// Extra headers (ie. Content-Range, Cache-Control...)
+	std::vector<std::pair<std::string, std::string>> headers;
+
+private:
+	friend class HTTPServer;
+	int fd = -1;
+	uint64_t offset = 0, size = 0;
+	t_reader reader;
+};
+
+// Streaming mode: the body is not buffered but handed over as it arrives,
+// the user callback is still called (with an empty body) once it ends.
+class HTTPStreamHandler {
+public:
+	// Called once the headers are in, returns 0 to accept the request or
+	// an HTTP status to reject it right away (the body is not read)
+	std::function<unsigned(const HTTPReq*)> headers;
+	// Called for every body chunk, returning false aborts the connection
+	std::function<bool(const HTTPReq*, const char *data, size_t size)> data;
+	// Called when an accepted request goes away before the user callback
+	std::function<void(const HTTPReq*)> aborted;
+};
+
+// Webhook mode: Telegram updates are acknowledged as soon as they are
+// received and queued for workers (see HTTPServer::nextUpdate).
+class HTTPWebhookOpts {
+public:
+	std::string secret;           // Expected secret token header (empty: no check)
+	std::string path;             // Only accept POSTs to this URL (empty: any)
+	unsigned maxqueue = 1024;     // Updates waiting for workers, 503 beyond that (Telegram retries)
+	// Updates larger than this get a 413 (replaces the server max_req_size,
+	// long messages with entities or a quoted reply go well over 8KB)
+	size_t maxbody = HTTP_WEBHOOK_MAXBODY;
 };
 
+class HTTPWebhookStats {
+public:
+	uint64_t received;            // Updates queued
+	uint64_t duplicates;          // Dropped, update_id already seen
+	uint64_t rejected;            // Bad secret, path, method or size
+	uint64_t overflows;           // Queue was full
+};
+
+// Remembers the last HTTP_WEBHOOK_DEDUP update ids, as a bitmap window
+// below the highest one. Older ids are accepted, they can only come after
+// a long outage.
+class HTTPUpdateDedup {
+public:
+	// Returns whether the id was seen already, and marks it
+	bool seen(uint64_t id) {
+		if (id > maxid) {
+			for (uint64_t i = maxid + 1; i <= id && i <= maxid + HTTP_WEBHOOK_DEDUP; i++)
+				bits[i % HTTP_WEBHOOK_DEDUP] = false;
+			maxid = id;
+		}
+		else if (maxid - id >= HTTP_WEBHOOK_DEDUP)
+			return false;
+		bool ret = bits[id % HTTP_WEBHOOK_DEDUP];
+		bits[id % HTTP_WEBHOOK_DEDUP] = true;
+		return ret;
+	}
+
+private:
+	uint64_t maxid = 0;
+	std::vector<bool> bits = std::vector<bool>(HTTP_WEBHOOK_DEDUP);
+};
+
+// Server tuning, zero means microhttpd's default
+class HTTPServerOpts {
+public:
+	bool epoll = false;            // Use epoll instead of select (Linux only)
+	unsigned threads = 1;          // Number of polling threads (thread pool if > 1)
+	unsigned max_conns = 0;        // Maximum concurrent connections
+	unsigned conn_timeout = 0;     // Idle connection timeout (seconds)
+	unsigned listen_backlog = 0;   // listen() backlog
+	// Multi-instance: several servers (or processes) on the same port get
+	// their own accept queue with SO_REUSEPORT, or can share a pre-bound
+	// listening socket (owned by the caller, port is then ignored).
+	bool reuseport = false;
+	int listen_fd = -1;
+	int cpu = -1;                  // Pin the daemon threads to this CPU (Linux only)
+	// Requests not responded in time get this response (0: wait forever)
+	unsigned reply_timeout = 0;    // Seconds
+	unsigned timeout_status = 504;
+	std::string timeout_body;
+	// Per-route metrics, served in Prometheus text format on metrics_path.
+	// Routes are (method, path prefix), first match wins, empty method
+	// matches any. Unmatched requests are accounted as route "*".
+	bool metrics = false;
+	std::string metrics_path = "/metrics";
+	std::vector<std::pair<std::string, std::string>> metric_routes;
+};
+
+// Request counters and latency histograms by route. Threads update their
+// own stripe with relaxed atomics, stripes are only summed when rendering.
+class HTTPMetrics {
+public:
+	HTTPMetrics(const std::vector<std::pair<std::string, std::string>> &rts) {
+		for (const auto & r : rts)
+			routes.emplace_back(new t_route(r.first, r.second));
+		routes.emplace_back(new t_route("", ""));
+	}
+
+	unsigned route(const char *method, const char *url) const {
+		for (unsigned i = 0; i < routes.size() - 1; i++) {
+			const t_route *r = routes[i].get();
+			if ((r->method.empty() || r->method == method) && !strncmp(url, r->prefix.c_str(), r->prefix.size()))
+				return i;
+		}
+		return routes.size() - 1;
+	}
+
+	// Request handed to the user, waited us since the first callback
+	void received(unsigned rt, uint64_t us, uint64_t bytes) {
+		t_stripe &s = stripe(rt);
+		s.requests.fetch_add(1, std::memory_order_relaxed);
+		s.bytesin.fetch_add(bytes, std::memory_order_relaxed);
+		s.wait.add(us);
+	}
+
+	// Response queued, us after the user callback
+	void responded(unsigned rt, uint64_t us, uint64_t bytes) {
+		t_stripe &s = stripe(rt);
+		s.bytesout.fetch_add(bytes, std::memory_order_relaxed);
+		s.handler.add(us);
+	}
+
+	void timedout(unsigned rt) {
+		stripe(rt).timeouts.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	std::string render() const {
+		std::string out;
+		counter(&out, "http_requests_total", "Requests handed to the handler", &t_stripe::requests);
+		counter(&out, "http_received_bytes_total", "Request body bytes", &t_stripe::bytesin);
+		counter(&out, "http_sent_bytes_total", "Response body bytes (known length only)", &t_stripe::bytesout);
+		counter(&out, "http_timeouts_total", "Requests reaped without response", &t_stripe::timeouts);
+		histogram(&out, "http_wait_seconds", "From headers received to handler callback", &t_stripe::wait);
+		histogram(&out, "http_handler_seconds", "From handler callback to response", &t_stripe::handler);
+		return out;
+	}
+
+	static unsigned bucket(uint64_t us) {
+		if (us < 4)
+			return us;
+		unsigned msb = 63 - __builtin_clzll(us);
+		return std::min(4 * (msb - 1) + ((us >> (msb - 2)) & 3), (uint64_t)HTTP_HIST_BUCKETS - 1);
+	}
+
+	// Upper bound (exclusive) of a bucket
+	static uint64_t bucketlimit(unsigned b) {
+		if (b < 4)
+			return b + 1;
+		unsigned msb = b / 4 + 1;
+		return (uint64_t)(4 + b % 4 + 1) << (msb - 2);
+	}
+
+private:
+	struct t_hist {
+		std::atomic<uint64_t> buckets[HTTP_HIST_BUCKETS];
+		std::atomic<uint64_t> sum;
+		void add(uint64_t us) {
+			buckets[bucket(us)].fetch_add(1, std::memory_order_relaxed);
+			sum.fetch_add(us, std::memory_order_relaxed);
+		}
+	};
+	struct alignas(64) t_stripe {
+		std::atomic<uint64_t> requests, bytesin, bytesout, timeouts;
+		t_hist wait, handler;
+	};
+	struct t_route {
+		t_route(std::string method, std::string prefix) : method(method), prefix(prefix), stripes() {}
+		std::string method, prefix;
+		t_stripe stripes[HTTP_METRIC_STRIPES];
+	};
+
+	t_stripe &stripe(unsigned rt) {
+		static thread_local unsigned tid = std::hash<std::thread::id>()(std::this_thread::get_id());
+		return routes[rt]->stripes[tid % HTTP_METRIC_STRIPES];
+	}
+
+	static std::string labels(const t_route *r) {
+		return "method=\"" + (r->method.empty() ? "*" : r->method) +
+		       "\",route=\"" + (r->prefix.empty() ? "*" : r->prefix) + "\"";
+	}
+
+	void counter(std::string *out, const char *name, const char *help,
+	             std::atomic<uint64_t> t_stripe::*field) const {
+		*out += std::string("# HELP ") + name + " " + help + "\n# TYPE " + name + " counter\n";
+		for (const auto & r : routes) {
+			uint64_t v = 0;
+			for (const auto & s : r->stripes)
+				v += (s.*field).load(std::memory_order_relaxed);
+			*out += name + ("{" + labels(r.get()) + "} ") + std::to_string(v) + "\n";
+		}
+	}
+
+	void histogram(std::string *out, const char *name, const char *help, t_hist t_stripe::*field) const {
+		*out += std::string("# HELP ") + name + " " + help + "\n# TYPE " + name + " histogram\n";
+		char le[32];
+		for (const auto & r : routes) {
+			std::string lbl = labels(r.get());
+			uint64_t count = 0, sum = 0;
+			for (unsigned b = 0; b < HTTP_HIST_BUCKETS; b++) {
+				for (const auto & s : r->stripes)
+					count += (s.*field).buckets[b].load(std::memory_order_relaxed);
+				if (b == HTTP_HIST_BUCKETS - 1)
+					strcpy(le, "+Inf");
+				else
+					snprintf(le, sizeof(le), "%.9g", bucketlimit(b) / 1e6);
+				*out += std::string(name) + "_bucket{" + lbl + ",le=\"" + le + "\"} " + std::to_string(count) + "\n";
+			}
+			for (const auto & s : r->stripes)
+				sum += (s.*field).sum.load(std::memory_order_relaxed);
+			snprintf(le, sizeof(le), "%.6f", sum / 1e6);
+			*out += std::string(name) + "_sum{" + lbl + "} " + le + "\n";
+			*out += std::string(name) + "_count{" + lbl + "} " + std::to_string(count) + "\n";
+		}
+	}
+
+	std::vector<std::unique_ptr<t_route>> routes;
+};
 
 class HTTPServer {
 public:
 	HTTPServer(unsigned port, std::function<void(const HTTPReq*)> usercb,
-	           unsigned max_req_size = 8*1024) {
+	           unsigned max_req_size = 8*1024, HTTPServerOpts opts = HTTPServerOpts()) {
 		this->daemon = NULL;
 		this->usercb = usercb;
 		this->port = port;
 		this->max_req_size = max_req_size;
+		this->opts = opts;
 		this->drained = false;
+		this->streaming = false;
+		this->webhook = false;
+		this->reaped = 0;
+		this->tick = 0;
+		this->reaperend = false;
+		if (opts.metrics)
+			this->metrics.reset(new HTTPMetrics(opts.metric_routes));
+	}
+
+	~HTTPServer() {
+		// Daemon and reaper must be gone before anything is freed
+		stop();
+		for (auto & p : pool)
+			for (auto r : p.reqs)
+				delete r;
+		for (auto r : graveyard)
+			delete r.second;
+	}
+
+	// Switches to streaming mode, must be called before serve()
+	void setStreamHandler(HTTPStreamHandler handler) {
+		this->streamh = handler;
+		this->streaming = true;
+	}
+
+	// Switches to webhook mode, must be called before serve()
+	void setWebhook(HTTPWebhookOpts wopts) {
+		this->wopts = wopts;
+		this->webhook = true;
+	}
+
+	// Webhook mode: blocks until an update is available, returns false once
+	// the server is stopped and the queue is empty.
+	bool nextUpdate(std::string *update) {
+		std::unique_lock<std::mutex> lock(whmtx);
+		while (whqueue.empty() && !whclosed)
+			whcond.wait(lock);
+		if (whqueue.empty())
+			return false;
+		*update = std::move(whqueue.front());
+		whqueue.pop_front();
+		return true;
+	}
+
+	HTTPWebhookStats getWebhookStats() const {
+		std::lock_guard<std::mutex> g(whmtx);
+		return whstats;
 	}
 
 	bool serve() {
 		// Create server and start listening
 		std::lock_guard<std::mutex> g(mtx);
+		unsigned flags = MHD_ALLOW_SUSPEND_RESUME;
+		flags |= opts.epoll ? MHD_USE_EPOLL_INTERNALLY : MHD_USE_SELECT_INTERNALLY;
+
+		std::vector<struct MHD_OptionItem> mopts;
+		if (opts.threads > 1)
+			mopts.push_back({MHD_OPTION_THREAD_POOL_SIZE, opts.threads, NULL});
+		if (opts.max_conns)
+			mopts.push_back({MHD_OPTION_CONNECTION_LIMIT, opts.max_conns, NULL});
+		if (opts.conn_timeout)
+			mopts.push_back({MHD_OPTION_CONNECTION_TIMEOUT, opts.conn_timeout, NULL});
+		if (opts.listen_backlog)
+			mopts.push_back({MHD_OPTION_LISTEN_BACKLOG_SIZE, opts.listen_backlog, NULL});
+		if (opts.listen_fd >= 0)
+			mopts.push_back({MHD_OPTION_LISTEN_SOCKET, opts.listen_fd, NULL});
+		else if (opts.reuseport)
+			mopts.push_back({MHD_OPTION_LISTENING_ADDRESS_REUSE, 1, NULL});
+		mopts.push_back({MHD_OPTION_END, 0, NULL});
+
+		// Daemon threads inherit the affinity of the thread creating them
+		#ifdef __linux__
+		cpu_set_t prevset;
+		bool pinned = false;
+		if (opts.cpu >= 0 && !pthread_getaffinity_np(pthread_self(), sizeof(prevset), &prevset)) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(opts.cpu, &set);
+			pinned = !pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		}
+		#endif
+
 		daemon = MHD_start_daemon(
-			MHD_USE_SELECT_INTERNALLY | MHD_ALLOW_SUSPEND_RESUME, port, NULL, NULL,
-			&http_callback, this, MHD_OPTION_END);
+			flags, port, NULL, NULL, &http_callback, this,
+			MHD_OPTION_NOTIFY_COMPLETED, &completed_callback, this,
+			MHD_OPTION_ARRAY, mopts.data(), MHD_OPTION_END);
+
+		#ifdef __linux__
+		if (pinned)
+			pthread_setaffinity_np(pthread_self(), sizeof(prevset), &prevset);
+		#endif
+
+		if (daemon && opts.reply_timeout && !reaperth.joinable())
+			reaperth = std::thread(&HTTPServer::reaper, this);
 		return daemon;
 	}
 
+	// Number of requests that got the timeout response
+	uint64_t getReaped() const {
+		return reaped;
+	}
+
 	void stop() {
+		// Stop accepting new connections, callbacks will do nothing but return.
+		// The listening socket is ours to close, once the daemon is gone.
+		MHD_socket ls = MHD_INVALID_SOCKET;
 		{
-			// Stop accepting new connections and clean up everything
 			std::lock_guard<std::mutex> g(mtx);
 			if (daemon)
-				MHD_quiesce_daemon(daemon);
-			// Ensure all callbacks will do nothing but return
-			drained = true;
-			
-			// Now proceed to clean up any ongoing reqs
-			for (auto it : ongoing)
-				delete it.second;
-			for (auto it : toreply) {
-				// This is required to call stop()
-				MHD_resume_connection(it.second);
-				delete it.first;
+				ls = MHD_quiesce_daemon(daemon);
+		}
+		drained = true;
+
+		// Resume (to close) the requests still waiting for a response
+		for (auto & s : pending) {
+			std::lock_guard<std::mutex> g(s.mtx);
+			for (auto & head : s.slots) {
+				for (HTTPReq *r = head; r; r = r->next) {
+					r->state = HTTPReq::Aborted;
+					// This is required to call stop()
+					MHD_resume_connection(r->conn);
+				}
+				head = NULL;
 			}
-			ongoing.clear();
-			toreply.clear();
+		}
 
+		// The reaper has nothing else to do
+		{
+			std::lock_guard<std::mutex> g(reapermtx);
+			reaperend = true;
+			reapercond.notify_all();
 		}
+		if (reaperth.joinable())
+			reaperth.join();
+
 		// Now we can kill the daemon more or less cleanly
-		if (daemon)
-			MHD_stop_daemon(daemon);
-		daemon = NULL;
+		{
+			std::lock_guard<std::mutex> g(mtx);
+			if (daemon)
+				MHD_stop_daemon(daemon);
+			daemon = NULL;
+		}
+		// Unless the caller owns it (with SO_REUSEPORT the kernel would keep
+		// queueing connections to it otherwise)
+		if (ls != MHD_INVALID_SOCKET && opts.listen_fd < 0)
+			close(ls);
+
+		// Webhook workers can drain what is left
+		std::lock_guard<std::mutex> g(whmtx);
+		whclosed = true;
+		whcond.notify_all();
 	}
 
-	bool respond(const HTTPReq *req, const HTTPResp *resp) {
-		// Check whether we have a pending request for this at all!
-		std::lock_guard<std::mutex> g(mtx);
-		if (!daemon || drained)
-			return false;
+	// Responds to a request passed to the user callback, only once.
+	// The request object must not be used afterwards.
+	// The body is copied (and file descriptors duplicated), use the
+	// move variant to hand the response over instead.
+	bool respond(const HTTPReq *creq, const HTTPResp *resp) {
+		return finish(creq, resp->status, respsize(resp), [resp] () -> struct MHD_Response* {
+			struct MHD_Response *mresp;
+			if (resp->reader)
+				mresp = streamresp(resp->size, new HTTPResp::t_reader(resp->reader));
+			else if (resp->fd >= 0) {
+				int fd = dup(resp->fd);
+				mresp = fd < 0 ? NULL : fileresp(fd, resp->offset, resp->size);
+			}
+			else
+				mresp = MHD_create_response_from_buffer(
+					resp->data.size(), (char*)resp->data.c_str(), MHD_RESPMEM_MUST_COPY);
+			return addheaders(mresp, resp);
+		});
+	}
+
+	// Same but takes ownership of the response, its body is not copied
+	bool respond(const HTTPReq *creq, HTTPResp &&resp) {
+		return finish(creq, resp.status, respsize(&resp), [&resp] () -> struct MHD_Response* {
+			struct MHD_Response *mresp;
+			if (resp.reader)
+				mresp = streamresp(resp.size, new HTTPResp::t_reader(std::move(resp.reader)));
+			else if (resp.fd >= 0) {
+				mresp = fileresp(resp.fd, resp.offset, resp.size);
+				resp.fd = -1;
+			}
+			else
+				mresp = bufresp(new std::string(std::move(resp.data)));
+			return addheaders(mresp, &resp);
+		});
+	}
+
+private:
+	size_t bodylimit() const {
+		return webhook ? wopts.maxbody : max_req_size;
+	}
+
+	static uint64_t respsize(const HTTPResp *resp) {
+		if (resp->reader)
+			return resp->size == MHD_SIZE_UNKNOWN ? 0 : resp->size;
+		return resp->fd >= 0 ? resp->size : resp->data.size();
+	}
+
+	static uint64_t nowus() {
+		return std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
 
-		struct MHD_Connection *connection = this->toreply[req];
-		if (!connection)
+	bool finish(const HTTPReq *creq, unsigned status, uint64_t outbytes,
+	            std::function<struct MHD_Response*()> mkresp) {
+		HTTPReq *req = const_cast<HTTPReq*>(creq);
+		t_pending &s = shard(req);
+		std::lock_guard<std::mutex> g(s.mtx);
+		if (drained || req->state != HTTPReq::Pending)
 			return false;
+		unlink(s, req);
+		req->state = HTTPReq::Done;
+		if (metrics)
+			metrics->responded(req->route, nowus() - req->tcb, outbytes);
+
+		// Queue a response, the connection is closed if it cannot be built
+		struct MHD_Connection *connection = req->conn;
+		struct MHD_Response *mresp = mkresp();
+		if (mresp) {
+			MHD_queue_response(connection, status, mresp);
+			MHD_destroy_response(mresp);
+		}
+		else
+			req->state = HTTPReq::Aborted;
+
+		// Can start to respond now that the connection has some response.
+		// The request is released once the connection completes it.
+		MHD_resume_connection(connection);
+
+		return mresp;
+	}
+
+	// Builders for the different response kinds. They take ownership of
+	// their argument, even on failure.
+	static struct MHD_Response *bufresp(std::string *body) {
+		#if MHD_VERSION >= 0x00097302
+		struct MHD_Response *mresp = MHD_create_response_from_buffer_with_free_callback_cls(
+			body->size(), body->data(), [] (void *p) { delete (std::string*)p; }, body);
+		#else
+		struct MHD_Response *mresp = MHD_create_response_from_callback(
+			body->size(), HTTP_STREAM_BLOCK,
+			[] (void *p, uint64_t pos, char *buf, size_t max) -> ssize_t {
+				std::string *b = (std::string*)p;
+				size_t n = std::min(max, (size_t)(b->size() - pos));
+				memcpy(buf, b->data() + pos, n);
+				return n;
+			}, body, [] (void *p) { delete (std::string*)p; });
+		#endif
+		if (!mresp)
+			delete body;
+		return mresp;
+	}
+
+	static struct MHD_Response *fileresp(int fd, uint64_t offset, uint64_t size) {
+		struct MHD_Response *mresp = MHD_create_response_from_fd_at_offset64(size, fd, offset);
+		if (!mresp)
+			close(fd);
+		return mresp;
+	}
 
-		// Queue a response
+	static struct MHD_Response *streamresp(uint64_t size, HTTPResp::t_reader *reader) {
+		struct MHD_Response *mresp = MHD_create_response_from_callback(
+			size, HTTP_STREAM_BLOCK,
+			[] (void *p, uint64_t pos, char *buf, size_t max) -> ssize_t {
+				return (*(HTTPResp::t_reader*)p)(pos, buf, max);
+			}, reader, [] (void *p) { delete (HTTPResp::t_reader*)p; });
+		if (!mresp)
+			delete reader;
+		return mresp;
+	}
+
+	static struct MHD_Response *addheaders(struct MHD_Response *mresp, const HTTPResp *resp) {
+		if (mresp) {
+			MHD_add_response_header(mresp, MHD_HTTP_HEADER_CONTENT_TYPE, resp->content_type.c_str());
+			for (const auto & h : resp->headers)
+				MHD_add_response_header(mresp, h.first.c_str(), h.second.c_str());
+		}
+		return mresp;
+	}
+
+	static MHD_Result quickresp(struct MHD_Connection *connection, unsigned status) {
 		struct MHD_Response *mresp = MHD_create_response_from_buffer(
-			resp->data.size(), (char*)resp->data.c_str(), MHD_RESPMEM_MUST_COPY);
-		MHD_add_response_header(mresp, MHD_HTTP_HEADER_CONTENT_TYPE, resp->content_type.c_str());
-		MHD_queue_response(connection, resp->status, mresp);
+			0, (void*)"", MHD_RESPMEM_PERSISTENT);
+		MHD_Result ret = MHD_queue_response(connection, status, mresp);
 		MHD_destroy_response(mresp);
+		return ret;
+	}
 
-		// Cleanup
-		toreply.erase(req);
-		delete req;
-
-		// Can start to respond now that the connection has some response
-		MHD_resume_connection(connection);
-		
+	// Finds the (top level) update_id, Telegram sends it first
+	static bool updateid(const std::string &body, uint64_t *id) {
+		size_t p = body.find("\"update_id\"");
+		if (p == std::string::npos)
+			return false;
+		p += 11;
+		while (p < body.size() && (body[p] == ' ' || body[p] == ':'))
+			p++;
+		if (p >= body.size() || body[p] < '0' || body[p] > '9')
+			return false;
+		*id = strtoull(&body[p], NULL, 10);
 		return true;
 	}
 
-private:
+	// Acks the update and queues it for the workers
+	MHD_Result webhookdone(struct MHD_Connection *connection, HTTPReq *req) {
+		req->state = HTTPReq::Done;
+		if (req->truncated) {
+			std::lock_guard<std::mutex> g(whmtx);
+			whstats.rejected++;
+			return quickresp(connection, 413);
+		}
+
+		uint64_t id;
+		bool hasid = updateid(req->body, &id);
+		{
+			std::lock_guard<std::mutex> g(whmtx);
+			if (whqueue.size() >= wopts.maxqueue) {
+				whstats.overflows++;
+				return quickresp(connection, 503);
+			}
+			if (hasid && whdedup.seen(id))
+				whstats.duplicates++;
+			else {
+				whstats.received++;
+				whqueue.push_back(std::move(req->body));
+				whcond.notify_one();
+			}
+		}
+		return quickresp(connection, 200);
+	}
+
+	// Requests handed to the user, by shard, so respond() and stop() can
+	// find them without a global lock. Each shard is a timer wheel indexed
+	// by the request deadline (in reaper ticks).
+	struct t_pending {
+		std::mutex mtx;
+		HTTPReq *slots[HTTP_WHEEL_SLOTS] = {};
+	};
+
+	t_pending &shard(const HTTPReq *req) {
+		return pending[(std::hash<const void*>()(req) >> 4) % HTTP_PENDING_SHARDS];
+	}
+
+	void link(t_pending &s, HTTPReq *req) {
+		HTTPReq *&head = s.slots[req->deadline % HTTP_WHEEL_SLOTS];
+		req->prev = NULL;
+		req->next = head;
+		if (head)
+			head->prev = req;
+		head = req;
+	}
+
+	void unlink(t_pending &s, HTTPReq *req) {
+		if (req->prev)
+			req->prev->next = req->next;
+		else
+			s.slots[req->deadline % HTTP_WHEEL_SLOTS] = req->next;
+		if (req->next)
+			req->next->prev = req->prev;
+		req->prev = req->next = NULL;
+	}
+
+	// Walks one wheel slot per tick, timing out expired requests. Those are
+	// kept away from the pool for a while, so a late respond() finds them
+	// Reaped instead of answering some other request.
+	void reaper() {
+		auto next = std::chrono::steady_clock::now();
+		std::unique_lock<std::mutex> lock(reapermtx);
+		while (!reaperend) {
+			next += std::chrono::milliseconds(HTTP_WHEEL_TICK_MS);
+			reapercond.wait_until(lock, next);
+			if (reaperend)
+				break;
+			lock.unlock();
+
+			uint64_t t = ++tick;
+			for (auto & s : pending) {
+				std::lock_guard<std::mutex> g(s.mtx);
+				HTTPReq *r = s.slots[t % HTTP_WHEEL_SLOTS];
+				while (r) {
+					HTTPReq *nr = r->next;
+					if (r->deadline <= t && !drained) {
+						unlink(s, r);
+						r->state = HTTPReq::Reaped;
+						struct MHD_Response *mresp = MHD_create_response_from_buffer(
+							opts.timeout_body.size(), (void*)opts.timeout_body.data(),
+							MHD_RESPMEM_MUST_COPY);
+						MHD_queue_response(r->conn, opts.timeout_status, mresp);
+						MHD_destroy_response(mresp);
+						MHD_resume_connection(r->conn);
+						reaped++;
+						if (metrics)
+							metrics->timedout(r->route);
+					}
+					r = nr;
+				}
+			}
+
+			uint64_t grace = HTTP_REAPED_GRACE * 1000 / HTTP_WHEEL_TICK_MS;
+			std::vector<HTTPReq*> expired;
+			{
+				std::lock_guard<std::mutex> g(gravemtx);
+				while (!graveyard.empty() && graveyard.front().first + grace <= t) {
+					expired.push_back(graveyard.front().second);
+					graveyard.pop_front();
+				}
+			}
+			for (auto r : expired)
+				putreq(r);
+
+			lock.lock();
+		}
+	}
+
+	// Request objects are recycled, keeping their (capped) string buffers.
+	// The pool is sharded by thread, so daemon threads rarely contend.
+	struct t_pool {
+		std::mutex mtx;
+		std::vector<HTTPReq*> reqs;
+	};
+
+	t_pool &poolshard() {
+		static thread_local unsigned tid = std::hash<std::thread::id>()(std::this_thread::get_id());
+		return pool[tid % HTTP_PENDING_SHARDS];
+	}
+
+	HTTPReq *getreq(const char *method, const char *url) {
+		HTTPReq *req = NULL;
+		t_pool &p = poolshard();
+		{
+			std::lock_guard<std::mutex> g(p.mtx);
+			if (!p.reqs.empty()) {
+				req = p.reqs.back();
+				p.reqs.pop_back();
+			}
+		}
+		if (!req)
+			return new HTTPReq(method, url);
+		req->method = method;
+		req->url = url;
+		return req;
+	}
+
+	void putreq(HTTPReq *req) {
+		req->body.clear();
+		if (req->body.capacity() > HTTP_POOL_BODY_CAP)
+			std::string().swap(req->body);
+		req->truncated = false;
+		req->userptr = NULL;
+		req->inbytes = 0;
+		req->conn = NULL;
+		req->state = HTTPReq::Receiving;
+		t_pool &p = poolshard();
+		{
+			std::lock_guard<std::mutex> g(p.mtx);
+			if (p.reqs.size() < HTTP_POOL_SIZE / HTTP_PENDING_SHARDS) {
+				p.reqs.push_back(req);
+				return;
+			}
+		}
+		delete req;
+	}
+
+	// Connections can go away before the request is complete (timeouts,
+	// client errors...), in any of the daemon threads.
+	static void completed_callback(
+		void *cls, struct MHD_Connection *connection,
+		void **con_cls, enum MHD_RequestTerminationCode toe) {
+
+		HTTPServer *tptr = (HTTPServer*)cls;
+		HTTPReq *req = (HTTPReq*)*con_cls;
+		if (!req)
+			return;
+
+		// Pending requests are owned by respond()/stop() until they resume
+		// the connection, which always happens before completion.
+		t_pending &s = tptr->shard(req);
+		HTTPReq::State state;
+		{
+			std::lock_guard<std::mutex> g(s.mtx);
+			state = req->state;
+		}
+		if (state == HTTPReq::Pending)
+			return;
+		if (state == HTTPReq::Reaped) {
+			*con_cls = NULL;
+			std::lock_guard<std::mutex> g(tptr->gravemtx);
+			tptr->graveyard.emplace_back(tptr->tick.load(), req);
+			return;
+		}
+		if (state == HTTPReq::Receiving && tptr->streaming && tptr->streamh.aborted)
+			tptr->streamh.aborted(req);
+		*con_cls = NULL;
+		tptr->putreq(req);
+	}
 
 	static MHD_Result http_callback(
 		void *cls, struct MHD_Connection *connection,
@@ -118,36 +872,120 @@ private:
 		size_t *upload_data_size, void **con_cls) {
 
 		HTTPServer *tptr = (HTTPServer*)cls;
-		std::unique_lock<std::mutex> g(tptr->mtx);
 		if (tptr->drained)
 			return MHD_NO;
 
 		// Initialize the connection the first time this gets called, nothing else to do!
-		if (!tptr->ongoing.count(connection)) {
-			tptr->ongoing.emplace(connection, new HTTPReq(method, url));
+		HTTPReq *req = (HTTPReq*)*con_cls;
+		if (!req) {
+			req = tptr->getreq(method, url);
+			req->conn = connection;
+			*con_cls = req;
+
+			if (tptr->metrics) {
+				// Our own endpoint
+				if (tptr->opts.metrics_path == url && !strcmp(method, "GET")) {
+					req->state = HTTPReq::Done;
+					struct MHD_Response *mresp = bufresp(new std::string(tptr->metrics->render()));
+					if (!mresp)
+						return MHD_NO;
+					MHD_add_response_header(mresp, MHD_HTTP_HEADER_CONTENT_TYPE, "text/plain; version=0.0.4");
+					MHD_Result ret = MHD_queue_response(connection, 200, mresp);
+					MHD_destroy_response(mresp);
+					return ret;
+				}
+				req->route = tptr->metrics->route(method, url);
+				req->tstart = nowus();
+			}
+
+			if (tptr->streaming) {
+				// Let the handler look at the headers and reject early
+				unsigned status = tptr->streamh.headers ? tptr->streamh.headers(req) : 0;
+				if (status) {
+					req->state = HTTPReq::Done;
+					return quickresp(connection, status);
+				}
+				return MHD_YES;
+			}
+
+			if (tptr->webhook) {
+				// Check everything we can before reading the body
+				const char *secret = req->header(HTTP_WEBHOOK_SECRET);
+				unsigned status = 0;
+				if (strcmp(method, "POST"))
+					status = 405;
+				else if (!tptr->wopts.path.empty() && tptr->wopts.path != url)
+					status = 404;
+				else if (!tptr->wopts.secret.empty() && (!secret || tptr->wopts.secret != secret))
+					status = 403;
+				if (status) {
+					std::lock_guard<std::mutex> g(tptr->whmtx);
+					tptr->whstats.rejected++;
+					req->state = HTTPReq::Done;
+					return quickresp(connection, status);
+				}
+			}
+
+			// Reserve the body in advance, up to the limit
+			const char *cl = req->header(MHD_HTTP_HEADER_CONTENT_LENGTH);
+			if (cl)
+				req->body.reserve(std::min((unsigned long long)tptr->bodylimit(), strtoull(cl, NULL, 10)));
 			return MHD_YES;
 		}
 
-		HTTPReq *req = tptr->ongoing[connection];
-		
+		// Resumed without a response, only closing it stops the callbacks
+		if (req->state == HTTPReq::Aborted)
+			return MHD_NO;
+
+		// Rejected, just drop whatever body still comes
+		if (req->state == HTTPReq::Done) {
+			*upload_data_size = 0;
+			return MHD_YES;
+		}
+
+		req->inbytes += *upload_data_size;
+
+		// Stream the data to the handler
+		if (*upload_data_size && tptr->streaming) {
+			if (tptr->streamh.data && !tptr->streamh.data(req, upload_data, *upload_data_size))
+				return MHD_NO;
+		}
 		// Add data to the request if any
-		if (*upload_data_size) {
+		else if (*upload_data_size) {
 			// If over the limit, mark it as truncated and stop buffering.
-			if (req->body.size() > tptr->max_req_size)
+			size_t limit = tptr->bodylimit();
+			size_t room = limit - std::min(req->body.size(), limit);
+			if (*upload_data_size > room)
 				req->truncated = true;
-			else
-				req->body += std::string(upload_data, *upload_data_size);
+			req->body.append(upload_data, std::min(*upload_data_size, room));
+		}
+		else if (tptr->webhook) {
+			if (tptr->metrics)
+				tptr->metrics->received(req->route, nowus() - req->tstart, req->inbytes);
+			return tptr->webhookdone(connection, req);
 		}
 		else {
-			// Move the reference to the right queue, before the callback!
-			tptr->ongoing.erase(connection);
-			tptr->toreply.emplace(req, connection);
+			if (tptr->metrics) {
+				req->tcb = nowus();
+				tptr->metrics->received(req->route, req->tcb - req->tstart, req->inbytes);
+			}
 
-			// Since we do not plan to respond now, ensure we do not get any more callbacks
-			MHD_suspend_connection(connection);
+			// Hand it to the user, before the callback!
+			t_pending &s = tptr->shard(req);
+			{
+				std::lock_guard<std::mutex> g(s.mtx);
+				if (tptr->drained)
+					return MHD_NO;   // stop() already went through this shard
+				req->state = HTTPReq::Pending;
+				// Without timeout the slot does not matter, the reaper is not running
+				req->deadline = tptr->tick + (uint64_t)tptr->opts.reply_timeout * 1000 / HTTP_WHEEL_TICK_MS + 1;
+				tptr->link(s, req);
 
-			// User callback, pass request. Can unlock already to prevent deadlocks
-			g.unlock();
+				// Since we do not plan to respond now, ensure we do not get any more callbacks
+				MHD_suspend_connection(connection);
+			}
+
+			// User callback, pass request
 			tptr->usercb(req);
 		}
 
@@ -159,14 +997,36 @@ private:
 	// Daemon itself and configs
 	struct MHD_Daemon *daemon;
 	unsigned port, max_req_size;
+	HTTPServerOpts opts;
 	// User callback
 	std::function<void(const HTTPReq*)> usercb;
-	// Requests being processed, by connection
-	std::unordered_map<void*, HTTPReq*> ongoing;
-	// Requests indexed by request, for the purpose of replying
-	std::unordered_map<const HTTPReq*, struct MHD_Connection*> toreply;
-	// Multithread protections
+	// Streaming mode handler
+	HTTPStreamHandler streamh;
+	bool streaming;
+	// Webhook mode queue and dedup state
+	HTTPWebhookOpts wopts;
+	bool webhook;
+	std::deque<std::string> whqueue;
+	mutable std::mutex whmtx;
+	std::condition_variable whcond;
+	bool whclosed = false;
+	HTTPWebhookStats whstats = {};
+	HTTPUpdateDedup whdedup;
+	// Requests waiting for respond()
+	t_pending pending[HTTP_PENDING_SHARDS];
+	// Recycled request objects, reaped ones wait in the graveyard (by tick)
+	t_pool pool[HTTP_PENDING_SHARDS];
+	std::deque<std::pair<uint64_t, HTTPReq*>> graveyard;
+	std::mutex gravemtx;
+	// Reaper thread, ticks and stats
+	std::thread reaperth;
+	std::mutex reapermtx;
+	std::condition_variable reapercond;
+	bool reaperend;
+	std::atomic<uint64_t> tick, reaped;
+	// Optional per-route metrics
+	std::unique_ptr<HTTPMetrics> metrics;
+	// Daemon start/stop protection (callbacks can run in several daemon threads)
 	mutable std::mutex mtx;
-	bool drained;
+	std::atomic<bool> drained;
 };
-
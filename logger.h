@@ -3,10 +3,40 @@
 
 // Implements a log-on-disk that supports rotation
 // and compression and flushing.
+// Lines from one thread are written in order. Each flush writes the thread
+// buffers one after the other, so lines from different threads are only
+// ordered by flush (they are not merged by timestamp).
+
+#ifndef _LOGGER_HH__
+#define _LOGGER_HH__
 
 #include <mutex>
 #include <ctime>
+#include <chrono>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <string_view>
 #include <condition_variable>
+#include <zlib.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#define LOG_FLUSH_INTERVAL  std::chrono::milliseconds(100)  // Max time lines wait in memory
+#define LOG_FLUSH_RETRY     std::chrono::seconds(1)         // Wait after a write error
+#define LOG_RING_SIZE       (64*1024)                       // Per thread buffer (power of two)
+#define LOG_COMPRESS_CHUNK  (256*1024)                      // Read size while compressing
 
 static std::time_t last_midnight() {
 	std::time_t t = std::time(NULL);
@@ -25,107 +55,844 @@ static std::string logts(bool date = false) {
 	return fmtime;
 }
 
+#define LOG_BIN_MAGIC       "LOGBIN1\n"   // Binary log file header
+#define LOG_REC_HEADER      12           // Length (excluding itself), format id, time
+#define LOG_FMT_DEF         0            // Format id used for format definitions
+#define LOG_FMT_TEXT        1            // Format id used for text lines
+
+// Binary logging with an static format (registered once per call site).
+// In text mode the format is used directly, the registry is not touched.
+#define LOGB(logger, fmt, ...) do {                                 \
+	static const uint32_t _logfmt_id = Logger::fmtid(fmt);          \
+	(logger).logfmt(_logfmt_id, fmt, ##__VA_ARGS__);                \
+} while (0)
+
+// Log levels. Calls below LOG_MIN_LEVEL are removed at compile time,
+// the rest are checked against the logger level before evaluating any
+// of their arguments.
+#define LOGLVL_DEBUG        0
+#define LOGLVL_INFO         1
+#define LOGLVL_WARN         2
+#define LOGLVL_ERROR        3
+
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL       LOGLVL_DEBUG
+#endif
+
+#define LOGL(logger, lvl, fmt, ...) do {                             \
+	if ((lvl) >= LOG_MIN_LEVEL && (logger).enabled(lvl))            \
+		LOGB(logger, "{} " fmt, Logger::levelname(lvl), ##__VA_ARGS__); \
+} while (0)
+
+#define LOGD(logger, fmt, ...) LOGL(logger, LOGLVL_DEBUG, fmt, ##__VA_ARGS__)
+#define LOGI(logger, fmt, ...) LOGL(logger, LOGLVL_INFO, fmt, ##__VA_ARGS__)
+#define LOGW(logger, fmt, ...) LOGL(logger, LOGLVL_WARN, fmt, ##__VA_ARGS__)
+#define LOGE(logger, fmt, ...) LOGL(logger, LOGLVL_ERROR, fmt, ##__VA_ARGS__)
+
+// Per call site sampling (one every n calls) and rate limiting (at most n
+// lines per second), checked after the level.
+#define LOGL_EVERY_N(logger, lvl, n, fmt, ...) do {                  \
+	static LogSampler _log_sampler;                                 \
+	if ((lvl) >= LOG_MIN_LEVEL && (logger).enabled(lvl) &&          \
+	    _log_sampler.sample(n))                                     \
+		LOGB(logger, "{} " fmt, Logger::levelname(lvl), ##__VA_ARGS__); \
+} while (0)
+
+#define LOGL_RATELIMIT(logger, lvl, n, fmt, ...) do {                \
+	static LogRateLimit _log_ratelimit;                             \
+	if ((lvl) >= LOG_MIN_LEVEL && (logger).enabled(lvl) &&          \
+	    _log_ratelimit.allow(n))                                    \
+		LOGB(logger, "{} " fmt, Logger::levelname(lvl), ##__VA_ARGS__); \
+} while (0)
+
+struct LogSampler {
+	std::atomic<uint64_t> calls{0};
+
+	// One every n calls, n == 0 never samples (like a rate limit of 0)
+	bool sample(unsigned n) {
+		return n && calls.fetch_add(1, std::memory_order_relaxed) % n == 0;
+	}
+};
+
+struct LogRateLimit {
+	std::atomic<int64_t> window{0};     // Current second
+	std::atomic<uint32_t> count{0};     // Lines logged in this second
+	std::atomic<uint64_t> suppressed{0};
+
+	bool allow(unsigned n) {
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME_COARSE, &now);
+		int64_t w = window.load(std::memory_order_relaxed);
+		if (now.tv_sec != w && window.compare_exchange_strong(w, now.tv_sec, std::memory_order_relaxed))
+			count.store(0, std::memory_order_relaxed);
+		if (count.fetch_add(1, std::memory_order_relaxed) < n)
+			return true;
+		suppressed.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+};
+
+struct LogOptions {
+	int level = LOGLVL_DEBUG;  // Runtime level, see LOGL
+	bool binary = false;     // Write binary records instead of text lines
+	uint64_t maxsize = 0;    // Also rotate when the file reaches this size
+	bool compress = false;   // Gzip rotated files (in a background thread)
+	unsigned maxfiles = 0;   // Rotated files to keep (0 means no limit)
+	uint64_t maxbytes = 0;   // Disk space for rotated files (0 means no limit)
+
+	// Memory used by lines that do not fit in the thread rings, once reached
+	// producers either wait for the flusher or drop their lines.
+	uint64_t maxmemory = 0;  // 0 means no limit
+	bool blockonfull = false;
+
+	// Flush every flushinterval or as soon as flushsize bytes are pending
+	// (per thread ring or in the shared buffer).
+	std::chrono::milliseconds flushinterval = LOG_FLUSH_INTERVAL;
+	size_t flushsize = LOG_RING_SIZE / 2;
+	// Calls fdatasync() at most this often (0 means never)
+	std::chrono::milliseconds syncinterval{0};
+};
+
+struct LogStats {
+	uint64_t dropped = 0;       // Lines dropped due to maxmemory
+	uint64_t blocked = 0;       // Times a producer waited due to maxmemory
+	uint64_t writeerrors = 0;   // Failed writes (data is kept and retried)
+	int lasterror = 0;          // errno of the last failed write
+	uint64_t flushes = 0;       // Writes to disk
+	uint64_t flushns = 0;       // Time spent writing
+	uint64_t maxflushns = 0;
+	uint64_t syncs = 0;
+	uint64_t backlog = 0;       // Bytes waiting to be written
+
+	double avgFlushNs() const {
+		return flushes ? (double)flushns / flushes : 0.0;
+	}
+};
+
+// Argument of a binary record, encoded as a type tag followed by raw data
+struct LogArg {
+	char type = 's';
+	union {
+		int64_t i;
+		uint64_t u;
+		double d;
+	};
+	std::string_view s;
+
+	LogArg() : u(0) {}
+	template<typename T>
+	LogArg(const T &v) {
+		if constexpr (std::is_floating_point<T>::value) {
+			type = 'd'; d = v;
+		} else if constexpr (std::is_integral<T>::value && std::is_signed<T>::value) {
+			type = 'i'; i = v;
+		} else if constexpr (std::is_integral<T>::value) {
+			type = 'u'; u = v;
+		} else {
+			type = 's'; u = 0; s = v;
+		}
+	}
+
+	void append(std::string *out) const {
+		switch (type) {
+		case 'i': *out += std::to_string(i); break;
+		case 'u': *out += std::to_string(u); break;
+		case 's': *out += s; break;
+		case 'd': {
+			char tmp[32];
+			out->append(tmp, snprintf(tmp, sizeof(tmp), "%g", d));
+			} break;
+		};
+	}
+
+	bool decode(std::string_view *data) {
+		if (data->empty())
+			return false;
+		type = (*data)[0];
+		if (type == 's') {
+			uint32_t len;
+			if (data->size() < 1 + sizeof(len))
+				return false;
+			memcpy(&len, data->data() + 1, sizeof(len));
+			if (data->size() - 1 - sizeof(len) < len)
+				return false;
+			s = data->substr(1 + sizeof(len), len);
+			data->remove_prefix(1 + sizeof(len) + len);
+			return true;
+		}
+		if ((type != 'i' && type != 'u' && type != 'd') || data->size() < 1 + sizeof(u))
+			return false;
+		memcpy(&u, data->data() + 1, sizeof(u));
+		data->remove_prefix(1 + sizeof(u));
+		return true;
+	}
+};
+
 class Logger {
+	friend class LogDecoder;
 public:
-	Logger(std::string logfile) : logfile(logfile) {
+	Logger(std::string logfile, LogOptions opts = LogOptions())
+	 : logid(++idcounter()), logfile(logfile), opts(opts), level(opts.level) {
 		// Create/append first log file
 		rotatelog();
 
 		// Create thread and start
 		flusher = std::thread(&Logger::flushthread, this);
+
+		// Compress/delete old files in the background, starts with a pass
+		// to catch up with files rotated by previous runs.
+		if (opts.compress || opts.maxfiles || opts.maxbytes)
+			housekeeper = std::thread(&Logger::housekeepthread, this);
 	}
 
 	~Logger() {
 		// Set end and wake flush thread
 		{
-			std::unique_lock<std::mutex> lock(waitmu);
+			std::unique_lock<std::mutex> lock(mu);
 			end = true;
 		}
 		waitcond.notify_all();
+		spacecond.notify_all();
 
 		// Wait for thread
 		flusher.join();
+
+		// Pending compression is resumed on the next run
+		if (housekeeper.joinable()) {
+			{
+				std::lock_guard<std::mutex> guard(hkmu);
+				hkend = true;
+			}
+			hkcond.notify_all();
+			housekeeper.join();
+		}
+		if (logfd >= 0) {
+			if (opts.syncinterval.count())
+				fdatasync(logfd);
+			close(logfd);
+		}
+
+		// Threads might still hold references to our rings
+		for (auto & r : rings)
+			r->closed = true;
 	}
 
-	void log(std::string line) {
-		// Add line to memory buffer
+	void log(std::string_view line) {
+		if (opts.binary) {
+			// Plain text lines are stored as a "{}" record
+			logb(LOG_FMT_TEXT, line);
+			return;
+		}
+
+		// Cached per thread, only formatted once per second
+		std::string_view parts[3] = {tsprefix(), line, "\n"};
+		write(parts, 3);
+	}
+
+	// Binary logging: records the format id and the raw arguments, to be
+	// formatted offline (see decode()). Use it through the LOGB macro.
+	// Supported arguments are integers, floating point numbers and strings.
+	template<typename... Args>
+	void logb(uint32_t fmtid, const Args&... args) {
+		logfmt(fmtid, opts.binary ? "" : getformat(fmtid), args...);
+	}
+
+	// Same, with the format string at hand (used in text mode)
+	template<typename... Args>
+	void logfmt(uint32_t fmtid, const char *fmt, const Args&... args) {
+		if (!opts.binary) {
+			// Format in place instead
+			static thread_local std::string line;
+			const LogArg argv[] = {LogArg(), LogArg(args)...};
+			line.clear();
+			format(fmt, argv + 1, sizeof...(Args), &line);
+			log(line);
+			return;
+		}
+
+		static thread_local std::string rec;
+		rec.resize(LOG_REC_HEADER);
+		(encode(&rec, args), ...);
+		uint32_t hdr[3] = {(uint32_t)(rec.size() - sizeof(uint32_t)), fmtid, (uint32_t)tsnow()};
+		memcpy(&rec[0], hdr, sizeof(hdr));
+
+		std::string_view parts[1] = {rec};
+		write(parts, 1);
+	}
+
+	// Level checks are a relaxed load, can be changed at any time
+	bool enabled(int lvl) const {
+		return lvl >= level.load(std::memory_order_relaxed);
+	}
+
+	void setLevel(int lvl) {
+		level.store(lvl, std::memory_order_relaxed);
+	}
+
+	static const char *levelname(int lvl) {
+		static const char *names[] = {"D", "I", "W", "E"};
+		return lvl >= LOGLVL_DEBUG && lvl <= LOGLVL_ERROR ? names[lvl] : "?";
+	}
+
+	LogStats getStats() {
+		LogStats ret;
+		ret.dropped = stats.dropped.load(std::memory_order_relaxed);
+		ret.blocked = stats.blocked.load(std::memory_order_relaxed);
+		ret.writeerrors = stats.writeerrors.load(std::memory_order_relaxed);
+		ret.lasterror = stats.lasterror.load(std::memory_order_relaxed);
+		ret.flushes = stats.flushes.load(std::memory_order_relaxed);
+		ret.flushns = stats.flushns.load(std::memory_order_relaxed);
+		ret.maxflushns = stats.maxflushns.load(std::memory_order_relaxed);
+		ret.syncs = stats.syncs.load(std::memory_order_relaxed);
+
 		std::lock_guard<std::mutex> guard(mu);
-		logbuffer += logts() + " " + line + "\n";
+		ret.backlog = logbuffer.size() + flushpending.load(std::memory_order_relaxed);
+		for (auto & r : rings)
+			ret.backlog += r->head.load(std::memory_order_relaxed) - r->tail.load(std::memory_order_relaxed);
+		return ret;
+	}
 
-		// Tell flusher to flush this (lazily)
-		waitcond.notify_all();
+	// Registers a format string, returns its id. The pointer must remain
+	// valid (typically a string literal), formats use {} as placeholders.
+	static uint32_t fmtid(const char *fmt) {
+		auto & reg = formats();
+		std::lock_guard<std::mutex> guard(reg.mu);
+		reg.fmts.push_back(fmt);
+		return reg.fmts.size() - 1;
 	}
 
+	static const char *getformat(uint32_t id) {
+		auto & reg = formats();
+		std::lock_guard<std::mutex> guard(reg.mu);
+		return id < reg.fmts.size() ? reg.fmts[id] : "";
+	}
+
+	// Decodes a whole binary log file into text lines. Returns the number
+	// of bytes consumed, stops at the first truncated record. Returns -1 if
+	// the data is not valid binary log data. See LogDecoder for chunks.
+	static ssize_t decode(std::string_view data, std::string *out);
+
 private:
+	// Writes the concatenation of parts as a single log entry
+	void write(const std::string_view *parts, unsigned n) {
+		size_t size = 0;
+		for (unsigned i = 0; i < n; i++)
+			size += parts[i].size();
+
+		// Fast path: lock-free write to the thread's ring buffer, unless the
+		// ring overflowed (lines must go to the shared buffer to keep order)
+		LogRing *r = getring();
+		if (!r->overflowed.load(std::memory_order_relaxed)) {
+			uint64_t h = r->head.load(std::memory_order_relaxed);
+			uint64_t used = h - r->tail.load(std::memory_order_acquire);
+			if (used + size <= LOG_RING_SIZE) {
+				for (unsigned i = 0; i < n; i++) {
+					r->copy(h, parts[i]);
+					h += parts[i].size();
+				}
+				r->head.store(h, std::memory_order_release);
 
-	void rotatelog() {
-		// Try to rotate the log
+				// Only wake the flusher when the ring reaches flushsize
+				if (used < opts.flushsize && used + size >= opts.flushsize) {
+					wakeup = true;
+					waitcond.notify_one();
+				}
+				return;
+			}
+		}
+
+		// Slow path: add line to the shared buffer, stick to it until flushed
+		std::unique_lock<std::mutex> lock(mu);
+		if (opts.maxmemory && !fits(size)) {
+			if (!opts.blockonfull) {
+				stats.dropped.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+			stats.blocked.fetch_add(1, std::memory_order_relaxed);
+			wakeup = true;
+			waitcond.notify_one();
+			spacecond.wait(lock, [this, size] { return end || fits(size); });
+		}
+
+		size_t prev = logbuffer.size();
+		r->overflowed = true;
+		for (unsigned i = 0; i < n; i++)
+			logbuffer += parts[i];
+		if (prev < opts.flushsize && logbuffer.size() >= opts.flushsize) {
+			wakeup = true;
+			waitcond.notify_one();
+		}
+	}
+
+	// Whether size bytes fit in the shared buffer (holding mu)
+	bool fits(size_t size) const {
+		size_t backlog = logbuffer.size() + flushpending.load(std::memory_order_relaxed);
+		return backlog == 0 || backlog + size <= opts.maxmemory;
+	}
+
+	template<typename T>
+	static void encode(std::string *out, const T &v) {
+		LogArg a(v);
+		*out += a.type;
+		if (a.type == 's') {
+			uint32_t len = a.s.size();
+			out->append((char*)&len, sizeof(len));
+			*out += a.s;
+		}
+		else
+			out->append((char*)&a.u, sizeof(a.u));
+	}
+
+	// Replaces {} placeholders with the arguments
+	static void format(std::string_view fmt, const LogArg *args, size_t nargs, std::string *out) {
+		unsigned n = 0;
+		while (true) {
+			size_t p = fmt.find("{}");
+			if (p == std::string_view::npos || n >= nargs)
+				break;
+			out->append(fmt.substr(0, p));
+			args[n++].append(out);
+			fmt.remove_prefix(p + 2);
+		}
+		out->append(fmt);
+	}
+
+	// Global format registry, ids are shared by all loggers
+	struct FormatRegistry {
+		std::mutex mu;
+		std::vector<const char*> fmts = {"", "{}"};
+	};
+
+	static FormatRegistry &formats() {
+		static FormatRegistry reg;
+		return reg;
+	}
+
+	static std::time_t tsnow() {
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME_COARSE, &now);
+		return now.tv_sec;
+	}
+
+	// Single producer (the logging thread), single consumer (flusher) ring
+	struct LogRing {
+		alignas(64) std::atomic<uint64_t> head{0};   // Written by the producer
+		alignas(64) std::atomic<uint64_t> tail{0};   // Written by the flusher
+		std::atomic<bool> overflowed{false};         // Producer uses logbuffer
+		std::atomic<bool> orphan{false};             // Producer thread is gone
+		std::atomic<bool> closed{false};             // Logger is gone
+		char buf[LOG_RING_SIZE];
+
+		void copy(uint64_t pos, std::string_view data) {
+			size_t off = pos & (LOG_RING_SIZE - 1);
+			size_t first = std::min(data.size(), LOG_RING_SIZE - off);
+			memcpy(&buf[off], data.data(), first);
+			memcpy(buf, data.data() + first, data.size() - first);
+		}
+	};
+
+	// Rings used by the current thread (one per Logger instance)
+	struct ThreadRings {
+		std::vector<std::pair<uint64_t, std::shared_ptr<LogRing>>> rings;
+		~ThreadRings() {
+			for (auto & r : rings)
+				r.second->orphan = true;
+		}
+	};
+
+	static std::atomic<uint64_t> &idcounter() {
+		static std::atomic<uint64_t> cnt(0);
+		return cnt;
+	}
+
+	static ThreadRings &threadrings() {
+		static thread_local ThreadRings trings;
+		return trings;
+	}
+
+	static std::string_view tsprefix() {
+		static thread_local std::time_t cachedsec = -1;
+		static thread_local char prefix[64];
+		static thread_local size_t prefixlen = 0;
+
+		std::time_t now = tsnow();
+		if (now != cachedsec) {
+			struct tm tm;
+			cachedsec = now;
+			prefixlen = std::strftime(prefix, sizeof(prefix), "%Y%m%d-%H%M%S ", localtime_r(&cachedsec, &tm));
+		}
+		return std::string_view(prefix, prefixlen);
+	}
+
+	LogRing *getring() {
+		auto & trings = threadrings().rings;
+		for (auto it = trings.begin(); it != trings.end(); ) {
+			if (it->first == logid)
+				return it->second.get();
+			// Drop rings that belong to destroyed loggers
+			if (it->second->closed)
+				it = trings.erase(it);
+			else
+				++it;
+		}
+
+		auto r = std::make_shared<LogRing>();
+		trings.emplace_back(logid, r);
+		std::lock_guard<std::mutex> guard(mu);
+		rings.push_back(r);
+		return r.get();
+	}
+
+	std::string logname(unsigned seq) const {
+		return logfile + "_" + logdate + (seq ? "." + std::to_string(seq) : "") + (opts.binary ? ".bin" : "");
+	}
+
+	// Switches to a new file on date change, or when the current one is full
+	void rotatelog(bool full = false) {
 		std::string localtime = logts(true);
-		if (this->logdate == localtime && logfd >= 0)
+		if (this->logdate == localtime && logfd >= 0 && !full)
 			return;   // Already using that log
 
+		if (this->logdate != localtime)
+			logseq = 0;
+		else if (logfd >= 0)
+			logseq++;
 		this->logdate = localtime;
-		if (logfd >= 0)
+		if (logfd >= 0) {
+			if (opts.syncinterval.count())
+				fdatasync(logfd);
 			close(logfd);
+		}
 
-		std::string fn = logfile + "_" + this->logdate;
+		// Skip files that were already rotated (by previous runs)
+		struct stat st;
+		while (!stat((logname(logseq) + ".gz").c_str(), &st) ||
+		       (opts.maxsize && !stat(logname(logseq).c_str(), &st) && (uint64_t)st.st_size >= opts.maxsize))
+			logseq++;
+
+		std::string fn = logname(logseq);
 		logfd = open(fn.c_str(), O_WRONLY | O_APPEND | O_CREAT, S_IRUSR | S_IWUSR);
+		logsize = logfd >= 0 ? lseek(logfd, 0, SEEK_END) : 0;
+		if (logfd < 0) {
+			stats.writeerrors.fetch_add(1, std::memory_order_relaxed);
+			stats.lasterror.store(errno, std::memory_order_relaxed);
+		}
+
+		// Binary logs start with a header and need format definitions (again)
+		hdrbuf.clear();
+		hdroff = 0;
+		fmtwritten = 0;
+		if (opts.binary && logfd >= 0 && logsize == 0)
+			hdrbuf = LOG_BIN_MAGIC;
 
 		// Next run
 		next_rotation = last_midnight() + 24*60*60;
+
+		// The previous file can be compressed now
+		{
+			std::lock_guard<std::mutex> guard(hkmu);
+			curfile = fn;
+			hkpending = true;
+		}
+		hkcond.notify_all();
+	}
+
+	// Compresses src into src.gz (keeping its mtime), removes src on success
+	bool compressfile(const std::string &src) {
+		std::string dst = src + ".gz", tmp = dst + ".tmp";
+		int fd = open(src.c_str(), O_RDONLY);
+		if (fd < 0)
+			return false;
+		struct stat st;
+		fstat(fd, &st);
+
+		gzFile gz = gzopen(tmp.c_str(), "wb6");
+		bool ok = gz != NULL;
+		std::vector<char> buf(LOG_COMPRESS_CHUNK);
+		while (ok && !hkend) {
+			ssize_t r = read(fd, buf.data(), buf.size());
+			if (r <= 0) {
+				ok = (r == 0);
+				break;
+			}
+			ok = gzwrite(gz, buf.data(), r) == r;
+		}
+		close(fd);
+		ok = ok && !hkend;
+		if (gz && gzclose(gz) != Z_OK)
+			ok = false;
+
+		if (ok) {
+			struct timespec times[2] = {st.st_atim, st.st_mtim};
+			utimensat(AT_FDCWD, tmp.c_str(), times, 0);
+			ok = !rename(tmp.c_str(), dst.c_str());
+		}
+		if (ok)
+			unlink(src.c_str());
+		else
+			unlink(tmp.c_str());
+		return ok;
+	}
+
+	// Compresses rotated files and applies the retention limits
+	void housekeep() {
+		size_t sl = logfile.rfind('/');
+		std::string dir = sl == std::string::npos ? "." : logfile.substr(0, sl + 1);
+		std::string prefix = (sl == std::string::npos ? logfile : logfile.substr(sl + 1)) + "_";
+
+		struct t_file {
+			std::string path;
+			std::time_t mtime;
+			uint64_t size;
+		};
+		std::vector<t_file> files;
+		DIR *d = opendir(dir.c_str());
+		if (!d)
+			return;
+		while (struct dirent *e = readdir(d)) {
+			std::string name = e->d_name;
+			// Only our own files (prefix followed by a date)
+			if (name.compare(0, prefix.size(), prefix) || name.size() <= prefix.size() ||
+			    !isdigit(name[prefix.size()]) || name.find(".tmp") != std::string::npos)
+				continue;
+			std::string path = (sl == std::string::npos ? "" : dir) + name;
+			struct stat st;
+			if (!iscurrent(path) && !stat(path.c_str(), &st) && S_ISREG(st.st_mode))
+				files.push_back({path, st.st_mtime, (uint64_t)st.st_size});
+		}
+		closedir(d);
+
+		// The flusher might have rotated in the meantime
+		for (auto & f : files) {
+			if (!opts.compress || hkend || iscurrent(f.path) ||
+			    f.path.size() < 3 || !f.path.compare(f.path.size() - 3, 3, ".gz"))
+				continue;
+			if (compressfile(f.path)) {
+				struct stat st;
+				f.path += ".gz";
+				if (!stat(f.path.c_str(), &st))
+					f.size = st.st_size;
+			}
+		}
+
+		// Newest first, delete whatever goes over the limits
+		std::sort(files.begin(), files.end(), [] (const t_file &a, const t_file &b) {
+			return a.mtime > b.mtime || (a.mtime == b.mtime && a.path > b.path);
+		});
+		uint64_t total = 0;
+		for (unsigned i = 0; i < files.size(); i++) {
+			total += files[i].size;
+			if (((opts.maxfiles && i >= opts.maxfiles) || (opts.maxbytes && total > opts.maxbytes)) &&
+			    !iscurrent(files[i].path))
+				unlink(files[i].path.c_str());
+		}
+	}
+
+	bool iscurrent(const std::string &path) {
+		std::lock_guard<std::mutex> guard(hkmu);
+		return path == curfile;
+	}
+
+	void housekeepthread() {
+		// Compression is not urgent, run at the lowest priority so the
+		// flusher and the rest of the process get the CPU (on Linux the
+		// nice value is per thread).
+		setpriority(PRIO_PROCESS, 0, 19);
+
+		std::unique_lock<std::mutex> lock(hkmu);
+		while (true) {
+			hkcond.wait(lock, [this] { return hkend || hkpending; });
+			if (hkend)
+				break;
+			hkpending = false;
+			lock.unlock();
+			housekeep();
+			lock.lock();
+		}
+	}
+
+	// Writes the given buffers, returns the amount of bytes written
+	size_t writeall(std::vector<struct iovec> &iov) {
+		size_t total = 0;
+		for (unsigned i = 0; i < iov.size(); ) {
+			ssize_t w = writev(logfd, &iov[i], std::min(iov.size() - i, (size_t)IOV_MAX));
+			if (w < 0 && errno == EINTR)
+				continue;
+			if (w <= 0) {
+				stats.writeerrors.fetch_add(1, std::memory_order_relaxed);
+				stats.lasterror.store(w < 0 ? errno : ENOSPC, std::memory_order_relaxed);
+				break;
+			}
+			total += w;
+			// Skip the fully written buffers and adjust the partial one
+			for (; i < iov.size() && (size_t)w >= iov[i].iov_len; i++)
+				w -= iov[i].iov_len;
+			if (i < iov.size()) {
+				iov[i].iov_base = (char*)iov[i].iov_base + w;
+				iov[i].iov_len -= w;
+			}
+		}
+		return total;
+	}
+
+	// Adds any new format definitions to the header buffer
+	void writeformats() {
+		auto & reg = formats();
+		std::lock_guard<std::mutex> guard(reg.mu);
+		if (hdroff == hdrbuf.size()) {
+			hdrbuf.clear();
+			hdroff = 0;
+		}
+		for (; fmtwritten < reg.fmts.size(); fmtwritten++) {
+			uint32_t len = strlen(reg.fmts[fmtwritten]);
+			uint32_t hdr[4] = {(uint32_t)(LOG_REC_HEADER + len), LOG_FMT_DEF, (uint32_t)tsnow(), fmtwritten};
+			hdrbuf.append((char*)hdr, sizeof(hdr));
+			hdrbuf.append(reg.fmts[fmtwritten], len);
+		}
 	}
 
 	void flushthread() {
-		// Keeps flushing logs to disk periodically
+		// Keeps flushing logs to disk. Thread rings are flushed in place (using
+		// writev) and the shared buffer is double buffered: producers append to
+		// logbuffer while this thread writes flushbuf, they are swapped (not
+		// copied) once flushbuf is fully written.
+		std::string flushbuf;
+		size_t flushoff = 0;
+		std::vector<std::pair<std::shared_ptr<LogRing>, uint64_t>> snap;
+		std::vector<struct iovec> iov;
+		auto lastsync = std::chrono::steady_clock::now();
+		bool unsynced = false, failed = false;
+		std::unique_lock<std::mutex> lock(mu);
 		while (true) {
-			std::unique_lock<std::mutex> lock(waitmu);
-			waitcond.wait(lock);
-
-			bool empty = false;
-			do {
-				// Read buffer we want ot write
-				std::string chunk;
-				{
-					std::lock_guard<std::mutex> guard(mu);
-					chunk = logbuffer.substr(0, 256*1024);
-				}
+			// Do not spin on a failing disk, just retry every now and then
+			waitcond.wait_for(lock, failed ? LOG_FLUSH_RETRY : opts.flushinterval,
+			                  [this, failed] { return end || (!failed && wakeup.exchange(false)); });
+			bool finish = end, resumed = failed;
 
-				// Try to write as much as possible
-				int writtenbytes = 0;
-				while (!chunk.empty()) {
-					int w = write(logfd, &chunk[writtenbytes], chunk.size() - writtenbytes);
-					if (w > 0)
-						writtenbytes += w;
-					else
-						break;
-				}
+			// Take a snapshot of the rings. Their data goes before the shared
+			// buffer, so the producers can go back to their rings now. After
+			// a short write the rest of the same snapshot and buffer go first,
+			// newer ring data could belong after the shared buffer.
+			if (!resumed)
+				snap.clear();
+			for (auto it = rings.begin(); !resumed && it != rings.end(); ) {
+				auto & r = *it;
+				uint64_t h = r->head.load(std::memory_order_acquire);
+				uint64_t t = r->tail.load(std::memory_order_relaxed);
+				if (h != t)
+					snap.emplace_back(r, h);
+				if (flushoff == flushbuf.size())
+					r->overflowed = false;
+				if (h == t && r->orphan)
+					it = rings.erase(it);
+				else
+					++it;
+			}
+			if (!resumed && flushoff == flushbuf.size()) {
+				flushbuf.clear();   // Keeps capacity around
+				flushoff = 0;
+				flushbuf.swap(logbuffer);
+				flushpending = flushbuf.size();
+			}
+			lock.unlock();
 
-				// Remove the written bits
-				{
-					std::lock_guard<std::mutex> guard(mu);
-					logbuffer = logbuffer.substr(writtenbytes);
-					empty = logbuffer.empty();
-				}
+			// The file could not be opened last time
+			if (logfd < 0)
+				rotatelog();
 
-				// Check log rotation
-				if (time(NULL) > next_rotation && empty)
-					rotatelog();
-			} while (!empty);
+			// Formats used by the snapshot are registered by now
+			if (opts.binary)
+				writeformats();
 
-			if (end)
-				break;
+			// Write format definitions, rings (up to two chunks per ring) and
+			// then the shared buffer
+			iov.clear();
+			size_t pending = flushbuf.size() - flushoff + hdrbuf.size() - hdroff;
+			if (hdroff < hdrbuf.size())
+				iov.push_back({&hdrbuf[hdroff], hdrbuf.size() - hdroff});
+			for (auto & s : snap) {
+				LogRing *r = s.first.get();
+				uint64_t t = r->tail.load(std::memory_order_relaxed);
+				size_t off = t & (LOG_RING_SIZE - 1);
+				size_t len = s.second - t;
+				size_t first = std::min(len, LOG_RING_SIZE - off);
+				if (!len)
+					continue;   // Already written
+				iov.push_back({&r->buf[off], first});
+				if (len > first)
+					iov.push_back({r->buf, len - first});
+				pending += len;
+			}
+			if (flushoff < flushbuf.size())
+				iov.push_back({&flushbuf[flushoff], flushbuf.size() - flushoff});
+			size_t written = 0;
+			if (pending && logfd >= 0) {
+				auto start = std::chrono::steady_clock::now();
+				written = writeall(iov);
+				uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+					std::chrono::steady_clock::now() - start).count();
+				stats.flushes.fetch_add(1, std::memory_order_relaxed);
+				stats.flushns.fetch_add(ns, std::memory_order_relaxed);
+				if (ns > stats.maxflushns.load(std::memory_order_relaxed))
+					stats.maxflushns.store(ns, std::memory_order_relaxed);
+				unsynced = true;
+			}
+			logsize += written;
+
+			// Release the ring space that was written
+			bool empty = written == pending;
+			size_t hdrdone = std::min(written, hdrbuf.size() - hdroff);
+			hdroff += hdrdone;
+			written -= hdrdone;
+			for (auto & s : snap) {
+				LogRing *r = s.first.get();
+				uint64_t t = r->tail.load(std::memory_order_relaxed);
+				size_t done = std::min(written, (size_t)(s.second - t));
+				r->tail.store(t + done, std::memory_order_release);
+				written -= done;
+			}
+			flushoff += written;
+			flushpending = flushbuf.size() - flushoff;
+			spacecond.notify_all();
+
+			// Tell about write errors once, counters have the rest
+			if (!empty && !failed)
+				fprintf(stderr, "Logger: cannot write to %s: %s\n", curfile.c_str(),
+				        strerror(stats.lasterror.load(std::memory_order_relaxed)));
+			failed = !empty;
+
+			if (opts.syncinterval.count() && unsynced && logfd >= 0 &&
+			    std::chrono::steady_clock::now() - lastsync >= opts.syncinterval) {
+				fdatasync(logfd);
+				stats.syncs.fetch_add(1, std::memory_order_relaxed);
+				lastsync = std::chrono::steady_clock::now();
+				unsynced = false;
+			}
+
+			// Check log rotation (by date or size)
+			bool full = opts.maxsize && logsize >= opts.maxsize;
+			if ((time(NULL) > next_rotation || full) && empty)
+				rotatelog(full);
+
+			lock.lock();
+			if (finish && (!empty || (!resumed && logbuffer.empty() && snap.empty())))
+				break;   // Done (or can't write anyway)
 		}
 	}
 
-	// List of stuff to be flushed
+	// Shared buffer, for lines that do not fit in the thread rings
 	std::string logbuffer;
-	bool forceflush;
 	std::mutex mu;
+	// Per thread rings (owned by threads and this logger)
+	std::vector<std::shared_ptr<LogRing>> rings;
+	uint64_t logid;
 
 	// Thread that sits in the background flushing stuff
 	std::thread flusher;
-	std::mutex waitmu;
 	std::condition_variable waitcond;
+	std::atomic<bool> wakeup{false};
+	std::condition_variable spacecond;
+	std::atomic<size_t> flushpending{0};
 	std::string logdate;
 	bool end = false;
 
@@ -133,6 +900,115 @@ private:
 	std::string logfile;
 	int logfd = -1;
 	std::time_t next_rotation = 0;
+	LogOptions opts;
+	std::atomic<int> level;
+	uint64_t logsize = 0;
+	unsigned logseq = 0;
+
+	// Background compression and retention
+	std::thread housekeeper;
+	std::mutex hkmu;
+	std::condition_variable hkcond;
+	std::string curfile;
+	bool hkpending = false;
+	std::atomic<bool> hkend{false};
+
+	struct {
+		std::atomic<uint64_t> dropped{0}, blocked{0}, writeerrors{0};
+		std::atomic<int> lasterror{0};
+		std::atomic<uint64_t> flushes{0}, flushns{0}, maxflushns{0}, syncs{0};
+	} stats;
+
+	// Binary mode file header and format definitions
+	std::string hdrbuf;
+	size_t hdroff = 0;
+	uint32_t fmtwritten = 0;
+};
+
+// Streaming binary log decoder, data can be fed in chunks of any size. It
+// keeps the format definitions and the incomplete record between calls.
+class LogDecoder {
+public:
+	// Appends the text lines of the complete records to out, returns false
+	// (and stays failed) if the data is not valid binary log data
+	bool feed(std::string_view data, std::string *out) {
+		if (bad)
+			return false;
+		buf.append(data.data(), data.size());
+		std::string_view rest(buf);
+		bad = !decode(&rest, out);
+		consumed += buf.size() - rest.size();
+		buf.erase(0, buf.size() - rest.size());
+		return !bad;
+	}
+
+	// Bytes decoded so far, and bytes of an incomplete record kept for the
+	// next call (truncated data if anything is left at the end)
+	uint64_t offset() const { return consumed; }
+	size_t pending() const { return buf.size(); }
+
+private:
+	bool decode(std::string_view *data, std::string *out) {
+		const size_t mlen = sizeof(LOG_BIN_MAGIC) - 1;
+		if (!consumed) {
+			if (data->size() < mlen)
+				return !data->compare(0, data->size(), std::string_view(LOG_BIN_MAGIC, data->size()));
+			if (data->compare(0, mlen, LOG_BIN_MAGIC))
+				return false;
+			data->remove_prefix(mlen);
+		}
+
+		while (data->size() >= LOG_REC_HEADER) {
+			uint32_t hdr[3];
+			memcpy(hdr, data->data(), sizeof(hdr));
+			if (hdr[0] < LOG_REC_HEADER - sizeof(uint32_t))
+				return false;
+			if (data->size() - sizeof(uint32_t) < hdr[0])
+				break;   // Incomplete
+
+			std::string_view payload = data->substr(LOG_REC_HEADER, hdr[0] + sizeof(uint32_t) - LOG_REC_HEADER);
+			data->remove_prefix(hdr[0] + sizeof(uint32_t));
+
+			if (hdr[1] == LOG_FMT_DEF) {
+				// Format definition: id + format string
+				uint32_t id;
+				if (payload.size() < sizeof(id))
+					return false;
+				memcpy(&id, payload.data(), sizeof(id));
+				if (id >= fmts.size())
+					fmts.resize(id + 1);
+				fmts[id] = std::string(payload.substr(sizeof(id)));
+				continue;
+			}
+
+			args.clear();
+			while (!payload.empty()) {
+				LogArg a;
+				if (!a.decode(&payload))
+					return false;
+				args.push_back(a);
+			}
+
+			char ts[32];
+			struct tm tm;
+			std::time_t t = hdr[2];
+			out->append(ts, std::strftime(ts, sizeof(ts), "%Y%m%d-%H%M%S ", localtime_r(&t, &tm)));
+			Logger::format(hdr[1] < fmts.size() ? fmts[hdr[1]] : "?", args.data(), args.size(), out);
+			*out += '\n';
+		}
+		return true;
+	}
+
+	std::vector<std::string> fmts;
+	std::vector<LogArg> args;
+	std::string buf;
+	uint64_t consumed = 0;
+	bool bad = false;
 };
 
+inline ssize_t Logger::decode(std::string_view data, std::string *out) {
+	LogDecoder dec;
+	return dec.feed(data, out) ? dec.offset() : -1;
+}
 
+#endif
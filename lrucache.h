@@ -30,12 +30,23 @@
  */
 #pragma once
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <list>
 #include <mutex>
 #include <stdexcept>
 #include <thread>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
+#include <vector>
+
+#if defined(__GNUC__)
+#define LRU11_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define LRU11_PREFETCH(p)
+#endif
 
 namespace lru11 {
 
@@ -47,13 +58,164 @@ class NullLock {
   bool try_lock() { return true; }
 };
 
-template <typename K, typename V>
-struct KeyValuePair {
+// Insertion/update time (ms) of an entry, only stored when stats are on
+template <bool Stamped>
+struct KeyValueStamp {
+  uint32_t stamp;
+  explicit KeyValueStamp(uint32_t s) : stamp(s) {}
+  uint32_t getStamp() const { return stamp; }
+  void setStamp(uint32_t s) { stamp = s; }
+};
+
+// Without stats it's an empty base and takes no space in the node
+template <>
+struct KeyValueStamp<false> {
+  explicit KeyValueStamp(uint32_t) {}
+  uint32_t getStamp() const { return 0; }
+  void setStamp(uint32_t) {}
+};
+
+/**
+ * A cache entry, Stamped must match the Stats::enabled of the cache using
+ * it (ie. KeyValuePair<K, V, true> with AtomicStats).
+ */
+template <typename K, typename V, bool Stamped = false>
+struct KeyValuePair : KeyValueStamp<Stamped> {
  public:
   K key;
   V value;
 
-  KeyValuePair(const K& k, const V& v) : key(k), value(v) {}
+  KeyValuePair(const K& k, const V& v, uint32_t s = 0)
+      : KeyValueStamp<Stamped>(s), key(k), value(v) {}
+};
+
+/**
+ * Snapshot of the cache statistics. All counters are monotonic, take the
+ * difference of two snapshots to get rates. Snapshots from several caches
+ * (ie. shards) can be added together.
+ */
+struct CacheStats {
+  // Contended lock waits histogram, bucket N holds waits < 2^N us
+  static constexpr unsigned kWaitBuckets = 16;
+
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t inserts = 0;       // New keys inserted
+  uint64_t updates = 0;       // Existing keys overwritten
+  uint64_t prunes = 0;        // Number of prune() runs that evicted something
+  uint64_t evictions = 0;
+  uint64_t evictedAgeMs = 0;  // Sum of the age of the evicted entries
+  uint64_t lockAcquisitions = 0;
+  uint64_t lockContended = 0;  // Acquisitions that had to wait
+  uint64_t lockWaitNs = 0;     // Total time spent waiting for the lock
+  uint64_t lockWaitHist[kWaitBuckets] = {};
+
+  double hitRatio() const {
+    return hits + misses ? double(hits) / double(hits + misses) : 0.0;
+  }
+  double avgEvictionAgeMs() const {
+    return evictions ? double(evictedAgeMs) / double(evictions) : 0.0;
+  }
+  double avgLockWaitNs() const {
+    return lockContended ? double(lockWaitNs) / double(lockContended) : 0.0;
+  }
+
+  CacheStats& operator+=(const CacheStats& o) {
+    hits += o.hits;
+    misses += o.misses;
+    inserts += o.inserts;
+    updates += o.updates;
+    prunes += o.prunes;
+    evictions += o.evictions;
+    evictedAgeMs += o.evictedAgeMs;
+    lockAcquisitions += o.lockAcquisitions;
+    lockContended += o.lockContended;
+    lockWaitNs += o.lockWaitNs;
+    for (unsigned i = 0; i < kWaitBuckets; i++)
+      lockWaitHist[i] += o.lockWaitHist[i];
+    return *this;
+  }
+};
+
+// A noop stats concept (the default), all the calls compile to nothing
+class NullStats {
+ public:
+  static constexpr bool enabled = false;
+  static uint32_t now() { return 0; }
+  void hit() {}
+  void miss() {}
+  void inserted() {}
+  void updated() {}
+  void evicted(size_t, uint64_t) {}
+  void lockAcquired() {}
+  void lockWaited(uint64_t) {}
+  CacheStats snapshot() const { return CacheStats(); }
+};
+
+/**
+ * Stats collector based on relaxed atomics. Counters are only written with
+ * the cache lock held, so there's no need for atomic read-modify-write
+ * instructions, atomics are only used to allow lock-free snapshots.
+ */
+class AtomicStats {
+ public:
+  static constexpr bool enabled = true;
+  static uint32_t now() {
+    return uint32_t(std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+  }
+  void hit() { bump(hits_); }
+  void miss() { bump(misses_); }
+  void inserted() { bump(inserts_); }
+  void updated() { bump(updates_); }
+  void evicted(size_t count, uint64_t ageSumMs) {
+    if (!count)
+      return;
+    bump(prunes_);
+    bump(evictions_, count);
+    bump(evictedAgeMs_, ageSumMs);
+  }
+  void lockAcquired() { bump(lockAcquisitions_); }
+  void lockWaited(uint64_t ns) {
+    unsigned b = 0;
+    for (uint64_t us = ns >> 10; us && b < CacheStats::kWaitBuckets - 1;
+         us >>= 1)
+      b++;
+    bump(lockContended_);
+    bump(lockWaitNs_, ns);
+    bump(lockWaitHist_[b]);
+  }
+
+  CacheStats snapshot() const {
+    CacheStats ret;
+    ret.hits = load(hits_);
+    ret.misses = load(misses_);
+    ret.inserts = load(inserts_);
+    ret.updates = load(updates_);
+    ret.prunes = load(prunes_);
+    ret.evictions = load(evictions_);
+    ret.evictedAgeMs = load(evictedAgeMs_);
+    ret.lockAcquisitions = load(lockAcquisitions_);
+    ret.lockContended = load(lockContended_);
+    ret.lockWaitNs = load(lockWaitNs_);
+    for (unsigned i = 0; i < CacheStats::kWaitBuckets; i++)
+      ret.lockWaitHist[i] = load(lockWaitHist_[i]);
+    return ret;
+  }
+
+ private:
+  typedef std::atomic<uint64_t> counter_type;
+  static uint64_t load(const counter_type& c) {
+    return c.load(std::memory_order_relaxed);
+  }
+  static void bump(counter_type& c, uint64_t n = 1) {
+    c.store(load(c) + n, std::memory_order_relaxed);
+  }
+
+  counter_type hits_{0}, misses_{0}, inserts_{0}, updates_{0};
+  counter_type prunes_{0}, evictions_{0}, evictedAgeMs_{0};
+  counter_type lockAcquisitions_{0}, lockContended_{0}, lockWaitNs_{0};
+  counter_type lockWaitHist_[CacheStats::kWaitBuckets] = {};
 };
 
 /**
@@ -63,6 +225,9 @@ struct KeyValuePair {
  *		MapType - an associative container like std::unordered_map
  *		LockType - a lock type derived from the Lock class (default:
  *NullLock = no synchronization)
+ *		Stats - a stats collector (default: NullStats = no stats,
+ *AtomicStats collects hit/miss/eviction and lock wait stats, the Map
+ *		must then use KeyValuePair<Key, Value, true> nodes)
  *
  *	The default NullLock based template is not thread-safe, however passing
  *Lock=std::mutex will make it
@@ -70,14 +235,45 @@ struct KeyValuePair {
  */
 template <class Key, class Value, class Lock = NullLock,
           class Map = std::unordered_map<
-              Key, typename std::list<KeyValuePair<Key, Value>>::iterator>>
+              Key, typename std::list<KeyValuePair<Key, Value>>::iterator>,
+          class Stats = NullStats>
 class Cache {
  public:
-  typedef KeyValuePair<Key, Value> node_type;
-  typedef std::list<KeyValuePair<Key, Value>> list_type;
+  typedef KeyValuePair<Key, Value, Stats::enabled> node_type;
+  typedef std::list<node_type> list_type;
   typedef Map map_type;
+  static_assert(std::is_same<typename Map::mapped_type,
+                             typename list_type::iterator>::value,
+                "Map must map to std::list<KeyValuePair<Key, Value, "
+                "Stats::enabled>>::iterator");
   typedef Lock lock_type;
+  typedef Stats stats_type;
   using Guard = std::lock_guard<lock_type>;
+
+  // Lock guard that also accounts for the time spent on contended locks
+  class StatsGuard {
+   public:
+    StatsGuard(lock_type& lock, stats_type& stats) : lock_(lock) {
+      if (!stats_type::enabled) {
+        lock_.lock();
+        return;
+      }
+      if (!lock_.try_lock()) {
+        auto start = std::chrono::steady_clock::now();
+        lock_.lock();
+        stats.lockWaited(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count());
+      }
+      stats.lockAcquired();
+    }
+    ~StatsGuard() { lock_.unlock(); }
+
+   private:
+    StatsGuard(const StatsGuard&) = delete;
+    StatsGuard& operator=(const StatsGuard&) = delete;
+    lock_type& lock_;
+  };
+
   /**
    * the maxSize is the soft limit of keys and (maxSize + elasticity) is the
    * hard limit
@@ -91,44 +287,84 @@ class Cache {
       : maxSize_(maxSize), elasticity_(elasticity) {}
   virtual ~Cache() = default;
   size_t size() const {
-    Guard g(lock_);
+    StatsGuard g(lock_, stats_);
     return cache_.size();
   }
   bool empty() const {
-    Guard g(lock_);
+    StatsGuard g(lock_, stats_);
     return cache_.empty();
   }
   void clear() {
-    Guard g(lock_);
+    StatsGuard g(lock_, stats_);
     cache_.clear();
     keys_.clear();
   }
   void insert(const Key& k, const Value& v) {
-    Guard g(lock_);
-    const auto iter = cache_.find(k);
-    if (iter != cache_.end()) {
-      iter->second->value = v;
-      keys_.splice(keys_.begin(), keys_, iter->second);
-      return;
+    StatsGuard g(lock_, stats_);
+    if (insertNoPrune(k, v, stats_type::now()))
+      prune();
+  }
+  /**
+   * Inserts a range of std::pair<Key, Value> (or anything convertible to a
+   * const reference to it, like std::reference_wrapper) taking the lock only
+   * once. The cache is pruned at the end of the batch.
+   */
+  template <class It>
+  void multiInsert(It first, It last) {
+    StatsGuard g(lock_, stats_);
+    const uint32_t now = stats_type::now();
+    bool added = false;
+    for (; first != last; ++first) {
+      const std::pair<Key, Value>& kv = *first;
+      added |= insertNoPrune(kv.first, kv.second, now);
     }
-
-    keys_.emplace_front(k, v);
-    cache_[k] = keys_.begin();
-    prune();
+    if (added)
+      prune();
   }
   bool tryGet(const Key& kIn, Value& vOut) {
-    Guard g(lock_);
+    StatsGuard g(lock_, stats_);
     const auto iter = cache_.find(kIn);
     if (iter == cache_.end()) {
+      stats_.miss();
       return false;
     }
     keys_.splice(keys_.begin(), keys_, iter->second);
     vOut = iter->second->value;
+    stats_.hit();
     return true;
   }
 
+  /**
+   * Looks up a range of keys taking the lock only once. Hits are appended to
+   * vOut (in the same order as the keys) and the number of hits is returned.
+   * The key lookup runs one step ahead to prefetch the next hit entry.
+   */
+  template <class It>
+  size_t multiGet(It first, It last, std::vector<std::pair<Key, Value>>& vOut) {
+    StatsGuard g(lock_, stats_);
+    size_t found = 0;
+    auto next = first != last ? cache_.find(*first) : cache_.end();
+    while (first != last) {
+      const auto iter = next;
+      if (++first != last) {
+        next = cache_.find(*first);
+        if (next != cache_.end())
+          LRU11_PREFETCH(&*next->second);
+      }
+      if (iter == cache_.end()) {
+        stats_.miss();
+        continue;
+      }
+      keys_.splice(keys_.begin(), keys_, iter->second);
+      vOut.emplace_back(iter->first, iter->second->value);
+      stats_.hit();
+      found++;
+    }
+    return found;
+  }
+
   bool remove(const Key& k) {
-    Guard g(lock_);
+    StatsGuard g(lock_, stats_);
     auto iter = cache_.find(k);
     if (iter == cache_.end()) {
       return false;
@@ -138,7 +374,7 @@ class Cache {
     return true;
   }
   bool contains(const Key& k) const {
-    Guard g(lock_);
+    StatsGuard g(lock_, stats_);
     return cache_.find(k) != cache_.end();
   }
 
@@ -146,18 +382,42 @@ class Cache {
   size_t getElasticity() const { return elasticity_; }
   size_t getMaxAllowedSize() const { return maxSize_ + elasticity_; }
 
+  // Lock-free snapshot of the stats (all zeros when using NullStats)
+  CacheStats getStats() const { return stats_.snapshot(); }
+
  protected:
+  // Inserts or updates an entry, returns true if it was not present before
+  bool insertNoPrune(const Key& k, const Value& v, uint32_t now) {
+    const auto iter = cache_.find(k);
+    if (iter != cache_.end()) {
+      iter->second->value = v;
+      iter->second->setStamp(now);
+      keys_.splice(keys_.begin(), keys_, iter->second);
+      stats_.updated();
+      return false;
+    }
+
+    keys_.emplace_front(k, v, now);
+    cache_[k] = keys_.begin();
+    stats_.inserted();
+    return true;
+  }
+
   size_t prune() {
     size_t maxAllowed = maxSize_ + elasticity_;
     if (maxSize_ == 0 || cache_.size() < maxAllowed)
       return 0;
 
     size_t count = 0;
+    uint64_t ageSum = 0;
+    const uint32_t now = stats_type::now();
     while (cache_.size() > maxSize_) {
+      ageSum += uint32_t(now - keys_.back().getStamp());
       cache_.erase(keys_.back().key);
       keys_.pop_back();
       ++count;
     }
+    stats_.evicted(count, ageSum);
     return count;
   }
 
@@ -167,6 +427,7 @@ class Cache {
   Cache& operator=(const Cache&) = delete;
 
   mutable Lock lock_;
+  mutable Stats stats_;
   Map cache_;
   list_type keys_;
   size_t maxSize_;
@@ -0,0 +1,426 @@
+
+#include "galogger.h"
+#include <cassert>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <algorithm>
+#include <sstream>
+#include <set>
+
+static size_t filesize(const std::string &fn) {
+	struct stat st;
+	return stat(fn.c_str(), &st) ? 0 : st.st_size;
+}
+
+// Local batch endpoint: records the hits (lines) of every request it
+// accepts, or drops the connection without a response while down.
+// Requests are handled concurrently, each one waits delayms to respond.
+class FakeEndpoint {
+public:
+	std::atomic<bool> up{true};
+	std::atomic<unsigned> requests{0}, hits{0}, delayms{0};
+	std::atomic<unsigned> active{0}, maxactive{0};
+
+	FakeEndpoint() {
+		lfd = socket(AF_INET, SOCK_STREAM, 0);
+		struct sockaddr_in a = {};
+		a.sin_family = AF_INET;
+		a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t alen = sizeof(a);
+		assert(lfd >= 0 && !bind(lfd, (struct sockaddr*)&a, sizeof(a)) && !listen(lfd, 64));
+		assert(!getsockname(lfd, (struct sockaddr*)&a, &alen));
+		url = "http://127.0.0.1:" + std::to_string(ntohs(a.sin_port)) + "/batch";
+		th = std::thread(&FakeEndpoint::serve, this);
+	}
+	~FakeEndpoint() {
+		end = true;
+		th.join();
+		for (auto & t : conns)
+			t.join();
+		close(lfd);
+	}
+
+	// Hits per request, in arrival order
+	std::vector<unsigned> batches() {
+		std::lock_guard<std::mutex> g(mu);
+		return sizes;
+	}
+
+	std::string url;
+
+private:
+	void serve() {
+		while (!end) {
+			struct pollfd p = {lfd, POLLIN, 0};
+			if (poll(&p, 1, 20) <= 0)
+				continue;
+			int fd = accept(lfd, NULL, NULL);
+			if (fd >= 0)
+				conns.emplace_back(&FakeEndpoint::handle, this, fd);
+		}
+	}
+
+	void handle(int fd) {
+		unsigned a = ++active;
+		for (unsigned m = maxactive; a > m && !maxactive.compare_exchange_weak(m, a); )
+			;
+		// Headers and the Content-Length body
+		std::string in;
+		char buf[4096];
+		ssize_t n;
+		size_t he = std::string::npos, clen = 0;
+		while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+			in.append(buf, n);
+			if (he == std::string::npos && (he = in.find("\r\n\r\n")) != std::string::npos) {
+				size_t cl = in.find("Content-Length: ");
+				clen = cl < he ? strtoul(&in[cl + 16], NULL, 10) : 0;
+				if (in.find("Expect: 100-continue") < he)
+					(void)!send(fd, "HTTP/1.1 100 Continue\r\n\r\n", 25, MSG_NOSIGNAL);
+			}
+			if (he != std::string::npos && in.size() >= he + 4 + clen)
+				break;
+		}
+		if (up && he != std::string::npos) {
+			usleep(delayms * 1000);
+			unsigned lines = std::count(in.begin() + he + 4, in.end(), '\n');
+			{
+				std::lock_guard<std::mutex> g(mu);
+				sizes.push_back(lines);
+			}
+			requests++;
+			hits += lines;
+			active--;
+			std::string resp = "HTTP/1.1 200 OK\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+			(void)!send(fd, resp.data(), resp.size(), MSG_NOSIGNAL);
+		}
+		else
+			active--;
+		close(fd);
+	}
+
+	int lfd;
+	std::atomic<bool> end{false};
+	std::thread th;
+	std::vector<std::thread> conns;
+	std::mutex mu;
+	std::vector<unsigned> sizes;
+};
+
+// Hit fields as sorted "key=value" strings, v/qt/tid left out
+static std::vector<std::string> fields(const std::string &hit) {
+	std::vector<std::string> ret;
+	std::istringstream iss(hit);
+	for (std::string f; std::getline(iss, f, '&'); )
+		if (!f.empty() && f.compare(0, 2, "v=") && f.compare(0, 3, "qt=") && f.compare(0, 4, "tid="))
+			ret.push_back(f);
+	std::sort(ret.begin(), ret.end());
+	return ret;
+}
+
+// The serialization used before serialize_to(): the map, escaped by curl
+static std::string oldserialize(const GAUpdate &u) {
+	std::string ret;
+	for (const auto & it : u.serialize())
+		ret += it.first + "=" + HttpClient::urlescape(it.second) + "&";
+	return ret;
+}
+
+// Polls cond for up to 10s
+template <typename F>
+static bool waitfor(F cond) {
+	for (unsigned i = 0; i < 1000 && !cond(); i++)
+		usleep(10000);
+	return cond();
+}
+
+int main() {
+	// URL encoding matches curl_escape for every byte
+	for (unsigned c = 0; c < 256; c++) {
+		std::string in(1, (char)c), out;
+		GAUpdate::urlenc(&out, in);
+		assert(out == HttpClient::urlescape(in));
+	}
+	{
+		std::string out;
+		GAUpdate::append_field(&out, "dt", "a b&c=d/é");
+		assert(out == "&dt=a%20b%26c%3Dd%2F%C3%A9");
+	}
+
+	// serialize_to() writes the same fields as the old map based path
+	{
+		GAPageView pv(42, "Title & more = 100%", "bot.example.com", "/cmd?x=1 y");
+		pv.set_lang("es-ES");
+		GAEvent ev(7, "cat/sub", "act ion", "l&bel", 12);
+		GAEvent evnolabel(8, "cat", "act");
+		for (const GAUpdate *u : {(const GAUpdate*)&pv, (const GAUpdate*)&ev, (const GAUpdate*)&evnolabel}) {
+			std::string out;
+			u->serialize_to(&out);
+			assert(out[0] == '&');
+			assert(fields(out) == fields(oldserialize(*u)));
+		}
+		std::string out;
+		pv.serialize_to(&out);
+		assert(out == "&cid=42&ul=es-ES&t=pageview&dt=Title%20%26%20more%20%3D%20100%25"
+		              "&dh=bot.example.com&dp=%2Fcmd%3Fx%3D1%20y");
+		out.clear();
+		ev.serialize_to(&out);
+		assert(out == "&cid=7&ul=&t=event&ec=cat%2Fsub&ea=act%20ion&el=l%26bel&ev=12");
+		out.clear();
+		evnolabel.serialize_to(&out);
+		assert(out == "&cid=8&ul=&t=event&ec=cat&ea=act");
+
+		// Types that only implement serialize() go through the map
+		struct Custom : GAEvent {
+			Custom() : GAEvent(9, "c", "a") {}
+			std::unordered_multimap<std::string, std::string> serialize() const {
+				auto ret = GAEvent::serialize();
+				ret.emplace("cd1", "x y");
+				return ret;
+			}
+		} custom;
+		out.clear();
+		custom.serialize_to(&out);
+		assert(out.find("&cd1=x%20y") != std::string::npos);
+		assert(fields(out) == fields(oldserialize(custom)));
+	}
+
+	// Hit queue: count and byte limits (at least one hit always moves)
+	{
+		GAHitQueue q, out;
+		for (unsigned i = 0; i < 10; i++)
+			q.push(100 + i, 0, std::string(10 * (i + 1), 'x'));
+		assert(q.size() == 10 && q.bytes() == 550);
+
+		q.pop(3, &out);
+		assert(out.size() == 3 && out.bytes() == 60 && q.size() == 7);
+		assert(q.front().t == 103 && q.front().len == 40);
+
+		// 40+5, 50+5 fit in 100 bytes, 60+5 does not
+		out.clear();
+		q.pop(10, 100, 5, &out);
+		assert(out.size() == 2 && out.bytes() == 90);
+		// Too big for the limit, but moves anyway
+		out.clear();
+		q.pop(10, 10, 0, &out);
+		assert(out.size() == 1 && out.front().len == 60);
+
+		std::vector<uint64_t> ts;
+		q.foreach([&] (const GAHitQueue::t_hit &h, std::string_view f) {
+			assert(f.size() == h.len && f == std::string(h.len, 'x'));
+			ts.push_back(h.t);
+		});
+		assert((ts == std::vector<uint64_t>{106, 107, 108, 109}));
+		out.clear();
+		q.pop(100, &out);
+		assert(q.empty() && q.bytes() == 0 && out.size() == 4);
+	}
+
+	// Spool: append, partial replay, resume from the .pos file, truncate
+	std::string fn = "/tmp/galogger_test_" + std::to_string(getpid());
+	unlink(fn.c_str());
+	unlink((fn + ".pos").c_str());
+	{
+		GASpool sp(fn);
+		assert(sp.enabled() && sp.empty());
+		GAHitQueue q;
+		for (unsigned i = 0; i < 500; i++)
+			q.push(1000 + i, i % 3, "&cid=" + std::to_string(i));
+		assert(sp.append(q));
+		assert(!sp.empty());
+
+		GAHitQueue out;
+		assert(sp.replay(100, 0, &out) == 100 && out.size() == 100);
+		assert(out.front().t == 1000 && out.front().attempts == 0 && out.front().replayed);
+	}
+	{
+		// Reopened, continues after the first 100. Hits older than 1200 are
+		// consumed but not returned.
+		GASpool sp(fn);
+		GAHitQueue out;
+		assert(sp.replay(1000, 1200, &out) == 400);
+		assert(out.size() == 300 && out.front().t == 1200);
+		unsigned n = 200;
+		out.foreach([&] (const GAHitQueue::t_hit &h, std::string_view f) {
+			assert(f == "&cid=" + std::to_string(n));
+			assert(h.attempts == n % 3);
+			n++;
+		});
+		assert(sp.empty() && filesize(fn) == 0);
+
+		// Appends after a full replay start over
+		GAHitQueue q;
+		q.push(5, 1, "&cid=5");
+		assert(sp.append(q));
+	}
+	{
+		GASpool sp(fn);
+		GAHitQueue out;
+		assert(sp.replay(10, 0, &out) == 1 && out.front().t == 5);
+	}
+	unlink(fn.c_str());
+	unlink((fn + ".pos").c_str());
+
+	// Disabled spool
+	assert(!GASpool("").enabled());
+
+	// Aggregation: same (category, action, label) tuples are merged, even
+	// when fields would collide if just concatenated
+	{
+		GAAggregator agg;
+		agg.add(1, "cat", "act", "", 1);
+		agg.add(2, "cat", "act", "", 1);
+		agg.add(3, "cat", "act", "lbl", 5);
+		agg.add(4, "cat", "act", "lbl", 7);
+		agg.add(5, "ca", "tact", "", 1);
+		agg.add(6, "cat", "", "act", 1);
+
+		std::map<std::string, GAAggregator::t_count> got;
+		agg.take([&] (std::string_view c, std::string_view a, std::string_view l,
+		              const GAAggregator::t_count &cnt) {
+			got[std::string(c) + "|" + std::string(a) + "|" + std::string(l)] = cnt;
+		});
+		assert(got.size() == 4);
+		assert(got["cat|act|"].count == 2 && got["cat|act|"].userid == 1);
+		assert(got["cat|act|lbl"].count == 12 && got["cat|act|lbl"].userid == 3);
+		assert(got["ca|tact|"].count == 1 && got["cat||act"].count == 1);
+
+		// Flushed, nothing left
+		unsigned calls = 0;
+		agg.take([&] (std::string_view, std::string_view, std::string_view,
+		              const GAAggregator::t_count &) { calls++; });
+		assert(calls == 0);
+
+		// Concurrent producers
+		std::vector<std::thread> ths;
+		for (unsigned t = 0; t < 4; t++)
+			ths.emplace_back([&agg, t] {
+				for (unsigned i = 0; i < 1000; i++)
+					agg.add(t, "c", "a" + std::to_string(i % 10), "", 1);
+			});
+		for (auto & th : ths)
+			th.join();
+		uint64_t total = 0;
+		agg.take([&] (std::string_view, std::string_view, std::string_view,
+		              const GAAggregator::t_count &cnt) { total += cnt.count; calls++; });
+		assert(total == 4000 && calls == 10);
+	}
+
+	// Backoff: doubles per failure up to the max, jittered down by up to a half
+	{
+		GABackoff b(std::chrono::milliseconds(100), std::chrono::milliseconds(1000));
+		std::set<uint64_t> seen;
+		for (unsigned round = 0; round < 50; round++) {
+			for (unsigned f = 1; f <= 6; f++) {
+				uint64_t full = std::min<uint64_t>(1000, 100 << (f - 1));
+				uint64_t d = b.failed();
+				assert(b.failures() == f);
+				assert(d <= full && d >= full - full / 2);
+				if (f == 6)
+					seen.insert(d);
+			}
+			b.succeeded();
+			assert(b.failures() == 0);
+		}
+		assert(seen.size() > 1);
+
+		// No overflow after many failures
+		for (unsigned f = 0; f < 100; f++)
+			assert(b.failed() <= 1000);
+	}
+
+	// Batches are cut by hit count, not sent before they are full
+	{
+		FakeEndpoint ep;
+		GAOptions opts;
+		opts.url = ep.url;
+		opts.batchhits = 5;
+		opts.maxdelay = std::chrono::seconds(60);
+		GoogleAnalyticsLogger ga("UA-1", opts);
+		for (unsigned i = 0; i < 12; i++)
+			ga.push_event(GAEvent(i, "cat", "act"));
+		assert(waitfor([&] { return ga.getStats().sent == 10; }));
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		assert((ep.batches() == std::vector<unsigned>{5, 5}));
+		assert(ga.getStats().queuesize == 2);
+	}
+
+	// and by payload size (hit fields plus the per hit overhead)
+	{
+		FakeEndpoint ep;
+		GAOptions opts;
+		opts.url = ep.url;
+		opts.batchbytes = 1000;
+		opts.maxdelay = std::chrono::seconds(60);
+		GoogleAnalyticsLogger ga("UA-1", opts);
+		for (unsigned i = 0; i < 10; i++)
+			ga.push_event(GAEvent(i, "cat", "act", std::string(300, 'l')));
+		assert(waitfor([&] { return ep.requests >= 3; }));
+		for (unsigned n : ep.batches())
+			assert(n >= 1 && n <= 3);
+		assert(ga.getStats().bytes <= ep.requests * 1000);
+	}
+
+	// Incomplete batches go once the oldest hit waited maxdelay
+	{
+		FakeEndpoint ep;
+		GAOptions opts;
+		opts.url = ep.url;
+		opts.maxdelay = std::chrono::milliseconds(200);
+		GoogleAnalyticsLogger ga("UA-1", opts);
+		auto start = std::chrono::steady_clock::now();
+		for (unsigned i = 0; i < 3; i++)
+			ga.push_event(GAEvent(i, "cat", "act"));
+		assert(waitfor([&] { return ep.requests == 1; }));
+		assert(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(150));
+		assert((ep.batches() == std::vector<unsigned>{3}));
+	}
+
+	// At most maxinflight requests at once
+	{
+		FakeEndpoint ep;
+		ep.delayms = 100;
+		GAOptions opts;
+		opts.url = ep.url;
+		opts.batchhits = 1;
+		opts.maxinflight = 2;
+		GoogleAnalyticsLogger ga("UA-1", opts);
+		for (unsigned i = 0; i < 8; i++)
+			ga.push_event(GAEvent(i, "cat", "act"));
+		assert(waitfor([&] { return ga.getStats().sent == 8; }));
+		assert(ep.maxactive == 2 && ep.requests == 8);
+	}
+
+	// Outage then recovery with an idle queue: the spooled hits are
+	// replayed once the backoff is over, as the probe
+	{
+		unlink(fn.c_str());
+		unlink((fn + ".pos").c_str());
+		FakeEndpoint ep;
+		ep.up = false;
+		GAOptions opts;
+		opts.url = ep.url;
+		opts.spoolfile = fn;
+		opts.maxdelay = std::chrono::milliseconds(10);
+		opts.backoffbase = std::chrono::milliseconds(20);
+		opts.backoffmax = std::chrono::milliseconds(100);
+		{
+			GoogleAnalyticsLogger ga("UA-1", opts);
+			for (unsigned i = 0; i < 30; i++)
+				ga.push_event(GAEvent(i, "cat", "act"));
+			assert(waitfor([&] { GAStats st = ga.getStats(); return st.spooled >= 30 && !st.inflight; }));
+			assert(ga.getStats().failstreak > 0 && ga.getStats().sent == 0);
+
+			ep.up = true;
+			assert(waitfor([&] { return ga.getStats().sent == 30; }));
+			GAStats st = ga.getStats();
+			assert(st.failstreak == 0 && st.replayed == 30 && st.queuesize == 0);
+		}
+		assert(ep.hits == 30);
+		assert(GASpool(fn).empty());
+		unlink(fn.c_str());
+		unlink((fn + ".pos").c_str());
+	}
+}
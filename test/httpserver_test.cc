@@ -0,0 +1,446 @@
+
+#include "httpserver.h"
+#include <cassert>
+#include <sstream>
+#include <map>
+#include <set>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// Loopback listening socket for the server (on a free port)
+static int listener(unsigned *port) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in a = {};
+	a.sin_family = AF_INET;
+	a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t alen = sizeof(a);
+	assert(fd >= 0 && !bind(fd, (struct sockaddr*)&a, sizeof(a)) && !listen(fd, 64));
+	assert(!getsockname(fd, (struct sockaddr*)&a, &alen));
+	*port = ntohs(a.sin_port);
+	return fd;
+}
+
+// Sends a raw request, returns everything read until the server closes
+static std::string roundtrip(unsigned port, const std::string &req) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in a = {};
+	a.sin_family = AF_INET;
+	a.sin_port = htons(port);
+	a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	struct timeval tv = {10, 0};
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	assert(!connect(fd, (struct sockaddr*)&a, sizeof(a)));
+	assert(send(fd, req.data(), req.size(), MSG_NOSIGNAL) == (ssize_t)req.size());
+	std::string out;
+	char buf[4096];
+	ssize_t n;
+	while ((n = recv(fd, buf, sizeof(buf), 0)) > 0)
+		out.append(buf, n);
+	close(fd);
+	return out;
+}
+
+static std::string get(unsigned port, const std::string &url) {
+	return roundtrip(port, "GET " + url + " HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n");
+}
+
+int main() {
+	// Webhook update_id dedup
+	{
+		HTTPUpdateDedup d;
+		assert(!d.seen(100) && d.seen(100));
+		assert(!d.seen(99) && d.seen(99));    // Out of order, within the window
+		assert(!d.seen(105) && !d.seen(101) && d.seen(105));
+
+		// Slots are reused as the window moves on
+		uint64_t top = 100 + HTTP_WEBHOOK_DEDUP;
+		assert(!d.seen(top));                 // Same slot as 100
+		assert(!d.seen(100));                 // Fell out of the window, accepted
+		assert(!d.seen(100));
+		assert(!d.seen(top + 5) && d.seen(top + 5));   // 105's slot is clear now
+		assert(d.seen(top));
+
+		// Large jumps clear everything
+		uint64_t far = top + 10 * HTTP_WEBHOOK_DEDUP;
+		for (uint64_t i = far - HTTP_WEBHOOK_DEDUP + 1; i < far; i++)
+			assert(!d.seen(i));
+		assert(!d.seen(far) && d.seen(far) && d.seen(far - 1));
+	}
+
+	// Histogram buckets: exact below 4us, then 4 per power of two
+	{
+		for (uint64_t v = 0; v < 4; v++)
+			assert(HTTPMetrics::bucket(v) == v && HTTPMetrics::bucketlimit(v) == v + 1);
+		assert(HTTPMetrics::bucket(4) == 4 && HTTPMetrics::bucket(7) == 7);
+		assert(HTTPMetrics::bucket(8) == 8 && HTTPMetrics::bucket(9) == 8 && HTTPMetrics::bucket(10) == 9);
+		assert(HTTPMetrics::bucketlimit(8) == 10 && HTTPMetrics::bucketlimit(11) == 16);
+		assert(HTTPMetrics::bucket(1000) == HTTPMetrics::bucket(1023));
+		assert(HTTPMetrics::bucket(1024) == HTTPMetrics::bucket(1023) + 1);
+		assert(HTTPMetrics::bucket(~0ULL) == HTTP_HIST_BUCKETS - 1);
+
+		// Every value falls in [limit(b-1), limit(b))
+		for (uint64_t v = 0; v < (1 << 20); v += 1 + v / 64) {
+			unsigned b = HTTPMetrics::bucket(v);
+			assert(v < HTTPMetrics::bucketlimit(b));
+			assert(b == 0 || v >= HTTPMetrics::bucketlimit(b - 1));
+		}
+		for (unsigned b = 1; b < HTTP_HIST_BUCKETS; b++)
+			assert(HTTPMetrics::bucketlimit(b) > HTTPMetrics::bucketlimit(b - 1));
+	}
+
+	// Routes and Prometheus output
+	{
+		HTTPMetrics m({{"POST", "/api/"}, {"", "/static"}});
+		assert(m.route("POST", "/api/x") == 0);
+		assert(m.route("GET", "/api/x") == 2);
+		assert(m.route("GET", "/static/a.png") == 1);
+		assert(m.route("GET", "/") == 2);
+
+		m.received(0, 3, 100);       // bucket 3
+		m.received(0, 9, 50);        // bucket 8, [8, 10)
+		m.received(0, 5000000, 0);   // 5s
+		m.responded(0, 1, 10);
+		m.timedout(1);
+
+		std::map<std::string, std::string> vals;
+		std::istringstream iss(m.render());
+		std::string line;
+		while (std::getline(iss, line)) {
+			if (line.empty() || line[0] == '#')
+				continue;
+			size_t sp = line.rfind(' ');
+			vals[line.substr(0, sp)] = line.substr(sp + 1);
+		}
+
+		std::string r0 = "{method=\"POST\",route=\"/api/\"", r1 = "{method=\"*\",route=\"/static\"";
+		assert(vals["http_requests_total" + r0 + "}"] == "3");
+		assert(vals["http_received_bytes_total" + r0 + "}"] == "150");
+		assert(vals["http_sent_bytes_total" + r0 + "}"] == "10");
+		assert(vals["http_timeouts_total" + r1 + "}"] == "1");
+		assert(vals["http_requests_total{method=\"*\",route=\"*\"}"] == "0");
+
+		// Cumulative buckets
+		std::string w = "http_wait_seconds_bucket" + r0 + ",le=\"";
+		assert(vals[w + "3e-06\"}"] == "0");
+		assert(vals[w + "4e-06\"}"] == "1");
+		assert(vals[w + "8e-06\"}"] == "1");
+		assert(vals[w + "1e-05\"}"] == "2");
+		assert(vals[w + "4.194304\"}"] == "2");
+		assert(vals[w + "5.24288\"}"] == "3");
+		assert(vals[w + "+Inf\"}"] == "3");
+		assert(vals["http_wait_seconds_count" + r0 + "}"] == "3");
+		assert(vals["http_wait_seconds_sum" + r0 + "}"] == "5.000012");
+		assert(vals["http_handler_seconds_bucket" + r0 + ",le=\"2e-06\"}"] == "1");
+		assert(vals["http_handler_seconds_count" + r1 + "}"] == "0");
+
+		// Counts never decrease along the buckets
+		uint64_t prev = 0;
+		unsigned nb = 0;
+		for (const auto & it : vals) {
+			if (it.first.rfind(w, 0) != 0)
+				continue;
+			nb++;
+		}
+		assert(nb == HTTP_HIST_BUCKETS);
+		for (unsigned b = 0; b < HTTP_HIST_BUCKETS - 1; b++) {
+			char le[32];
+			snprintf(le, sizeof(le), "%.9g", HTTPMetrics::bucketlimit(b) / 1e6);
+			uint64_t c = std::stoull(vals[w + le + "\"}"]);
+			assert(c >= prev);
+			prev = c;
+		}
+	}
+
+	// A response that cannot be built closes the connection
+	{
+		unsigned port;
+		int lfd = listener(&port);
+		HTTPServerOpts opts;
+		opts.listen_fd = lfd;
+		bool sent = true;
+		HTTPServer *srv = NULL;
+		srv = new HTTPServer(0, [&srv, &sent] (const HTTPReq *req) {
+			if (req->url == "/bad") {
+				// Offsets past INT64_MAX are refused by libmicrohttpd
+				int fd = open("/dev/null", O_RDONLY);
+				sent = srv->respond(req, HTTPResp::file(200, "text/plain", fd, 1ULL << 63, 1));
+			}
+			else
+				srv->respond(req, HTTPResp(200, "text/plain", "ok"));
+		}, 8*1024, opts);
+		assert(srv->serve());
+		// Closed right away, not left waiting for a response that never comes
+		time_t t0 = time(NULL);
+		assert(get(port, "/bad").empty() && !sent);
+		assert(time(NULL) - t0 < 5);
+		std::string ok = get(port, "/good");
+		assert(ok.rfind("HTTP/1.1 200", 0) == 0 && ok.substr(ok.size() - 2) == "ok");
+		delete srv;
+		close(lfd);
+	}
+
+	// Webhook updates have their own size limit, well above max_req_size
+	{
+		unsigned port;
+		int lfd = listener(&port);
+		HTTPServerOpts opts;
+		opts.listen_fd = lfd;
+		HTTPServer srv(0, [] (const HTTPReq *) {}, 8*1024, opts);
+		srv.setWebhook(HTTPWebhookOpts());
+		assert(srv.serve());
+
+		auto post = [port] (const std::string &body) {
+			return roundtrip(port, "POST / HTTP/1.1\r\nHost: test\r\nConnection: close\r\nContent-Length: " +
+			                 std::to_string(body.size()) + "\r\n\r\n" + body);
+		};
+		std::string big = "{\"update_id\":1,\"message\":{\"text\":\"" + std::string(20000, 'x') + "\"}}";
+		assert(post(big).rfind("HTTP/1.1 200", 0) == 0);
+		std::string huge = "{\"update_id\":2,\"message\":{\"text\":\"" + std::string(HTTP_WEBHOOK_MAXBODY, 'x') + "\"}}";
+		assert(post(huge).rfind("HTTP/1.1 413", 0) == 0);
+
+		std::string upd;
+		assert(srv.nextUpdate(&upd) && upd == big);
+		HTTPWebhookStats st = srv.getWebhookStats();
+		assert(st.received == 1 && st.rejected == 1);
+		srv.stop();
+		assert(!srv.nextUpdate(&upd));
+		close(lfd);
+	}
+
+	// Thread pool and epoll: many requests pending at once, answered from
+	// another thread
+	{
+		unsigned port;
+		int lfd = listener(&port);
+		HTTPServerOpts opts;
+		opts.listen_fd = lfd;
+		opts.threads = 4;
+		opts.epoll = true;
+		opts.max_conns = 64;
+		std::mutex mtx;
+		std::condition_variable cond;
+		std::vector<const HTTPReq*> waiting;
+		HTTPServer srv(0, [&] (const HTTPReq *req) {
+			std::lock_guard<std::mutex> g(mtx);
+			waiting.push_back(req);
+			cond.notify_all();
+		}, 8*1024, opts);
+		assert(srv.serve());
+
+		const unsigned n = 16;
+		std::vector<std::string> got(n);
+		std::vector<std::thread> clients;
+		for (unsigned i = 0; i < n; i++)
+			clients.emplace_back([&got, port, i] { got[i] = get(port, "/req" + std::to_string(i)); });
+		{
+			std::unique_lock<std::mutex> lock(mtx);
+			assert(cond.wait_for(lock, std::chrono::seconds(10), [&] { return waiting.size() == n; }));
+			for (auto req : waiting)
+				assert(srv.respond(req, HTTPResp(200, "text/plain", "re " + req->url)));
+		}
+		for (auto & th : clients)
+			th.join();
+		for (unsigned i = 0; i < n; i++) {
+			std::string want = "\r\n\r\nre /req" + std::to_string(i);
+			assert(got[i].rfind("HTTP/1.1 200", 0) == 0);
+			assert(got[i].size() > want.size() && !got[i].compare(got[i].size() - want.size(), want.size(), want));
+		}
+		srv.stop();
+		close(lfd);
+	}
+
+	// Request objects are recycled and come back clean: no body, truncation
+	// or handler state from the previous request
+	{
+		unsigned port;
+		int lfd = listener(&port);
+		HTTPServerOpts opts;
+		opts.listen_fd = lfd;
+		std::set<const HTTPReq*> seen;
+		bool clean = true;
+		HTTPServer *srv = NULL;
+		srv = new HTTPServer(0, [&] (const HTTPReq *req) {
+			seen.insert(req);
+			if (req->method == "GET")
+				clean = clean && req->body.empty() && !req->truncated;
+			else
+				clean = clean && req->truncated && req->body == std::string(1024, 'b');
+			clean = clean && !req->userptr;
+			req->userptr = (void*)req;
+			srv->respond(req, HTTPResp(200, "text/plain", "ok"));
+		}, 1024, opts);
+		assert(srv->serve());
+		for (unsigned i = 0; i < 40; i++) {
+			if (i % 2)
+				assert(get(port, "/get").rfind("HTTP/1.1 200", 0) == 0);
+			else
+				assert(roundtrip(port, "POST /post HTTP/1.1\r\nHost: test\r\nConnection: close\r\n"
+				                       "Content-Length: 5000\r\n\r\n" + std::string(5000, 'b')).rfind("HTTP/1.1 200", 0) == 0);
+		}
+		assert(clean && seen.size() < 40);
+		delete srv;
+		close(lfd);
+	}
+
+	// Streaming mode: bodies over max_req_size reach the handler in full
+	// and are not buffered, headers can reject early, data can abort
+	{
+		unsigned port;
+		int lfd = listener(&port);
+		HTTPServerOpts opts;
+		opts.listen_fd = lfd;
+		std::atomic<unsigned> datacalls{0}, aborted{0};
+		std::string streamed, q;
+		bool buffered = false;
+		HTTPServer *srv = NULL;
+		srv = new HTTPServer(0, [&] (const HTTPReq *req) {
+			buffered = !req->body.empty() || req->truncated;
+			q = req->arg("q") ? req->arg("q") : "";
+			srv->respond(req, HTTPResp(200, "text/plain", std::to_string(streamed.size())));
+		}, 1024, opts);
+		HTTPStreamHandler h;
+		h.headers = [] (const HTTPReq *req) -> unsigned {
+			const char *t = req->header("X-Test");
+			return t && !strcmp(t, "reject") ? 413 : 0;
+		};
+		h.data = [&] (const HTTPReq *req, const char *data, size_t size) {
+			datacalls++;
+			if (req->url == "/abort")
+				return false;
+			streamed.append(data, size);
+			return true;
+		};
+		h.aborted = [&] (const HTTPReq *) { aborted++; };
+		srv->setStreamHandler(h);
+		assert(srv->serve());
+
+		auto post = [port] (const std::string &url, const std::string &hdr, const std::string &body) {
+			return roundtrip(port, "POST " + url + " HTTP/1.1\r\nHost: test\r\nConnection: close\r\n" + hdr +
+			                 "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body);
+		};
+		std::string body;
+		for (unsigned i = 0; body.size() < 50000; i++)
+			body += std::to_string(i) + ",";
+		std::string r = post("/up?q=a%20b", "", body);
+		assert(r.rfind("HTTP/1.1 200", 0) == 0 && r.substr(r.rfind("\r\n") + 2) == std::to_string(body.size()));
+		assert(streamed == body && !buffered && q == "a b" && datacalls > 1);
+
+		datacalls = 0;
+		assert(post("/up", "X-Test: reject\r\n", body).rfind("HTTP/1.1 413", 0) == 0);
+		assert(datacalls == 0);
+
+		assert(post("/abort", "", body).empty());
+		assert(datacalls == 1 && aborted == 1);
+		delete srv;
+		close(lfd);
+	}
+
+	// Reaper: requests not answered within reply_timeout get the timeout
+	// response, a late respond() is refused
+	{
+		unsigned port;
+		int lfd = listener(&port);
+		HTTPServerOpts opts;
+		opts.listen_fd = lfd;
+		opts.reply_timeout = 1;
+		opts.timeout_status = 503;
+		opts.timeout_body = "late";
+		std::mutex mtx;
+		std::vector<const HTTPReq*> slow;
+		HTTPServer *srv = NULL;
+		srv = new HTTPServer(0, [&] (const HTTPReq *req) {
+			if (req->url == "/fast")
+				srv->respond(req, HTTPResp(200, "text/plain", "fast"));
+			else {
+				std::lock_guard<std::mutex> g(mtx);
+				slow.push_back(req);
+			}
+		}, 8*1024, opts);
+		assert(srv->serve());
+
+		// Staggered, so they land on different wheel slots
+		auto start = std::chrono::steady_clock::now();
+		std::vector<std::string> got(3);
+		std::vector<std::thread> clients;
+		for (unsigned i = 0; i < 3; i++) {
+			clients.emplace_back([&got, port, i] { got[i] = get(port, "/slow"); });
+			std::this_thread::sleep_for(std::chrono::milliseconds(250));
+		}
+		assert(get(port, "/fast").find("\r\n\r\nfast") != std::string::npos);
+		for (auto & th : clients)
+			th.join();
+		auto took = std::chrono::steady_clock::now() - start;
+		assert(took >= std::chrono::milliseconds(1500) && took < std::chrono::seconds(5));
+		for (auto & r : got)
+			assert(r.rfind("HTTP/1.1 503", 0) == 0 && r.substr(r.size() - 4) == "late");
+		assert(srv->getReaped() == 3);
+		for (auto req : slow)
+			assert(!srv->respond(req, HTTPResp(200, "text/plain", "too late")));
+		delete srv;
+		close(lfd);
+	}
+
+	// Deleting the server closes the connections still waiting for a response
+	{
+		unsigned port;
+		int lfd = listener(&port);
+		HTTPServerOpts opts;
+		opts.listen_fd = lfd;
+		std::atomic<bool> called{false};
+		HTTPServer *srv = new HTTPServer(0, [&called] (const HTTPReq *) { called = true; }, 8*1024, opts);
+		assert(srv->serve());
+		std::string got = "unset";
+		std::thread client([&got, port] { got = get(port, "/never"); });
+		while (!called)
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		delete srv;
+		client.join();
+		assert(got.empty());
+		close(lfd);
+	}
+
+	// Two servers on one caller owned listening socket: stopping one leaves
+	// the socket open and the other one serving
+	{
+		unsigned port;
+		int lfd = listener(&port);
+		HTTPServerOpts opts;
+		opts.listen_fd = lfd;
+		HTTPServer *a = NULL, *b = NULL;
+		a = new HTTPServer(0, [&a] (const HTTPReq *req) { a->respond(req, HTTPResp(200, "text/plain", "A")); }, 8*1024, opts);
+		b = new HTTPServer(0, [&b] (const HTTPReq *req) { b->respond(req, HTTPResp(200, "text/plain", "B")); }, 8*1024, opts);
+		assert(a->serve() && b->serve());
+		for (unsigned i = 0; i < 10; i++)
+			assert(get(port, "/").rfind("HTTP/1.1 200", 0) == 0);
+		a->stop();
+		assert(fcntl(lfd, F_GETFD) != -1);
+		for (unsigned i = 0; i < 10; i++) {
+			std::string r = get(port, "/");
+			assert(r.rfind("HTTP/1.1 200", 0) == 0 && r.back() == 'B');
+		}
+		delete a;
+		delete b;
+		assert(fcntl(lfd, F_GETFD) != -1);
+		close(lfd);
+	}
+
+	// SO_REUSEPORT: two servers bind the same port
+	{
+		unsigned port;
+		close(listener(&port));
+		HTTPServerOpts opts;
+		opts.reuseport = true;
+		HTTPServer *a = NULL, *b = NULL;
+		a = new HTTPServer(port, [&a] (const HTTPReq *req) { a->respond(req, HTTPResp(200, "text/plain", "A")); }, 8*1024, opts);
+		b = new HTTPServer(port, [&b] (const HTTPReq *req) { b->respond(req, HTTPResp(200, "text/plain", "B")); }, 8*1024, opts);
+		assert(a->serve() && b->serve());
+		for (unsigned i = 0; i < 10; i++)
+			assert(get(port, "/").rfind("HTTP/1.1 200", 0) == 0);
+		delete a;
+		std::string r = get(port, "/");
+		assert(r.rfind("HTTP/1.1 200", 0) == 0 && r.back() == 'B');
+		delete b;
+	}
+}
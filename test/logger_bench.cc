@@ -0,0 +1,48 @@
+
+// Logger throughput under a burst of producers
+
+#include "logger.h"
+#include <cstdio>
+#include <vector>
+#include <sys/stat.h>
+
+int main(int argc, char **argv) {
+	unsigned nthreads = argc > 1 ? atoi(argv[1]) : 8;
+	unsigned nlines = argc > 2 ? atoi(argv[2]) : 200000;
+	std::string base = "/tmp/logger_bench_" + std::to_string(getpid());
+	bool binary = argc > 3 && std::string(argv[3]) == "bin";
+	std::string url = "http://example.com/some/file.mp4";
+	std::string fn = base + "_" + logts(true) + (binary ? ".bin" : "");
+
+	double tlog, ttotal;
+	auto start = std::chrono::steady_clock::now();
+	{
+		LogOptions opts;
+		opts.binary = binary;
+		Logger lg(base, opts);
+		std::vector<std::thread> ths;
+		for (unsigned t = 0; t < nthreads; t++)
+			ths.emplace_back([&lg, &url, nlines, binary] {
+				for (unsigned i = 0; i < nlines; i++) {
+					uint64_t uid = 123456789 + i;
+					if (binary)
+						LOGB(lg, "Update from user {}: /download {}", uid, url);
+					else
+						lg.log("Update from user " + std::to_string(uid) + ": /download " + url);
+				}
+			});
+		for (auto & th : ths)
+			th.join();
+		tlog = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+	ttotal = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	struct stat st;
+	stat(fn.c_str(), &st);
+	unlink(fn.c_str());
+
+	uint64_t total = (uint64_t)nthreads * nlines;
+	printf("%u threads x %u lines (%s): %.0f lines/s logged, %.0f lines/s on disk (%.1f ns/line per thread), %.1f bytes/line\n",
+	       nthreads, nlines, binary ? "binary" : "text", total / tlog, total / ttotal, tlog * 1e9 / nlines,
+	       (double)st.st_size / total);
+}
+
@@ -0,0 +1,284 @@
+
+#include "logger.h"
+#include <cassert>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <dirent.h>
+#include <csignal>
+
+static std::string readfile(std::string fn) {
+	std::ifstream ifs(fn);
+	std::stringstream ss;
+	ss << ifs.rdbuf();
+	return ss.str();
+}
+
+static unsigned evaluated = 0;
+static unsigned expensive() {
+	return ++evaluated;
+}
+
+int main() {
+	std::string base = "/tmp/logger_test_" + std::to_string(getpid());
+	std::string fn = base + "_" + logts(true);
+	unlink(fn.c_str());
+
+	{
+		Logger lg(base);
+		lg.log("first line");
+
+		// Several producers at once, the last one overflows its ring buffer
+		std::vector<std::thread> ths;
+		for (unsigned t = 0; t < 4; t++)
+			ths.emplace_back([&lg, t] {
+				std::string pad(t == 3 ? 2000 : 0, '.');
+				for (unsigned i = 0; i < 1000; i++) {
+					std::string l = "thread " + std::to_string(t) + " line " + std::to_string(i) + " ";
+					if (i % 100 == 50)
+						lg.log(l + std::string(LOG_RING_SIZE, '#'));
+					else
+						lg.log(l + pad);
+				}
+			});
+		for (auto & th : ths)
+			th.join();
+		lg.log("last line");
+	}
+
+	// Everything must be flushed on destruction, in order for each thread
+	std::string data = readfile(fn);
+	unsigned lines = 0;
+	std::vector<int> lastline(4, -1);
+	std::istringstream iss(data);
+	for (std::string l; std::getline(iss, l); lines++) {
+		auto sp = l.find(' ');
+		assert(sp == 15);   // YYYYmmdd-HHMMSS
+		std::string msg = l.substr(sp + 1);
+		if (!msg.compare(0, 7, "thread ")) {
+			unsigned t, i;
+			assert(sscanf(msg.c_str(), "thread %u line %u", &t, &i) == 2);
+			assert((int)i == lastline[t] + 1);
+			lastline[t] = i;
+		}
+	}
+	assert(lines == 4002);
+	// Threads flush independently, only per thread order is kept
+	size_t first = data.find(" first line\n"), last = data.find(" last line\n");
+	assert(first != std::string::npos && last != std::string::npos);
+	assert(first < last);
+	unlink(fn.c_str());
+
+	// Binary mode, decoded back to text
+	std::string fnb = fn + ".bin";
+	unlink(fnb.c_str());
+	{
+		LogOptions opts;
+		opts.binary = true;
+		Logger lg(base, opts);
+		std::vector<std::thread> ths;
+		for (unsigned t = 0; t < 4; t++)
+			ths.emplace_back([&lg, t] {
+				for (unsigned i = 0; i < 1000; i++)
+					LOGB(lg, "thread {} line {} user {} ratio {}", t, i, std::string("u") + std::to_string(i), -0.5);
+			});
+		for (auto & th : ths)
+			th.join();
+		lg.log("plain line");
+		LOGB(lg, "no args");
+	}
+	// Text mode formats binary calls in place
+	{
+		Logger lg(base);
+		LOGB(lg, "formatted {} {} {}", -3, 7u, "str");
+	}
+
+	std::string bin = readfile(fnb), dec;
+	assert(!bin.compare(0, 8, LOG_BIN_MAGIC));
+	assert(Logger::decode(bin, &dec) == (ssize_t)bin.size());
+	assert(Logger::decode(bin.substr(0, bin.size() - 1), &data) < (ssize_t)bin.size() - 1);
+	assert(Logger::decode("garbage!", &data) == -1);
+
+	// Streaming decoder: same output whatever the chunk size
+	for (size_t chunk : {1, 7, 4096}) {
+		LogDecoder d;
+		std::string sdec;
+		for (size_t p = 0; p < bin.size(); p += chunk)
+			assert(d.feed(std::string_view(bin).substr(p, chunk), &sdec));
+		assert(sdec == dec && d.offset() == bin.size() && !d.pending());
+	}
+	{
+		LogDecoder d;
+		std::string sdec;
+		assert(d.feed(std::string_view(bin).substr(0, bin.size() - 3), &sdec) && d.pending());
+		assert(d.offset() + d.pending() == bin.size() - 3);
+		LogDecoder g;
+		assert(g.feed("LOG", &sdec) && !g.feed("X", &sdec) && !g.feed(bin, &sdec));
+	}
+
+	lines = 0;
+	lastline.assign(4, -1);
+	std::istringstream bss(dec);
+	for (std::string l; std::getline(bss, l); lines++) {
+		assert(l.find(' ') == 15);
+		std::string msg = l.substr(16);
+		if (!msg.compare(0, 7, "thread ")) {
+			unsigned t, i;
+			char user[16];
+			assert(sscanf(msg.c_str(), "thread %u line %u user %15s", &t, &i, user) == 3);
+			assert((int)i == lastline[t] + 1);
+			assert(user == "u" + std::to_string(i));
+			assert(msg.substr(msg.size() - 10) == "ratio -0.5");
+			lastline[t] = i;
+		}
+	}
+	assert(lines == 4002);
+	assert(dec.find(" plain line\n") != std::string::npos);
+	assert(dec.find(" no args\n") != std::string::npos);
+	assert(readfile(fn).find(" formatted -3 7 str\n") != std::string::npos);
+	assert(bin.size() < dec.size());
+	unlink(fn.c_str());
+	unlink(fnb.c_str());
+
+	// Size rotation, compression and retention
+	char tmpdir[] = "/tmp/logger_test_XXXXXX";
+	assert(mkdtemp(tmpdir));
+	{
+		LogOptions opts;
+		opts.maxsize = 16*1024;
+		opts.compress = true;
+		opts.maxfiles = 3;
+		Logger lg(std::string(tmpdir) + "/bot", opts);
+		for (unsigned b = 0; b < 6; b++) {
+			for (unsigned i = 0; i < 200; i++)
+				lg.log("batch " + std::to_string(b) + " line " + std::to_string(i) + " " + std::string(80, '-'));
+			std::this_thread::sleep_for(std::chrono::milliseconds(300));
+		}
+	}
+	std::vector<std::string> files;
+	DIR *d = opendir(tmpdir);
+	while (struct dirent *e = readdir(d))
+		if (e->d_name[0] != '.')
+			files.push_back(std::string(tmpdir) + "/" + e->d_name);
+	closedir(d);
+
+	unsigned gzfiles = 0, plain = 0;
+	for (auto & f : files) {
+		if (f.find(".gz") == std::string::npos) {
+			plain++;
+			continue;
+		}
+		gzfiles++;
+		char buf[4096];
+		std::string content;
+		gzFile gz = gzopen(f.c_str(), "rb");
+		assert(gz);
+		for (int r; (r = gzread(gz, buf, sizeof(buf))) > 0; )
+			content.append(buf, r);
+		gzclose(gz);
+		assert(content.size() >= 16*1024);
+		assert(content.find(" batch ") == 15 && content.back() == '\n');
+	}
+	assert(plain == 1 && gzfiles == 3);
+	for (auto & f : files)
+		unlink(f.c_str());
+
+	// Memory cap: a missing directory acts as a stalled disk, lines get dropped
+	{
+		LogOptions opts;
+		opts.maxmemory = 4096;
+		Logger lg(std::string(tmpdir) + "/missing/bot", opts);
+		for (unsigned i = 0; i < 5000; i++)
+			lg.log("line " + std::to_string(i) + std::string(100, '.'));
+		std::this_thread::sleep_for(std::chrono::milliseconds(300));
+		LogStats st = lg.getStats();
+		assert(st.dropped > 0);
+		assert(st.writeerrors > 0 && st.lasterror == ENOENT);
+		assert(st.backlog <= LOG_RING_SIZE + opts.maxmemory);
+	}
+
+	// Blocking policy: nothing lost, producers wait for the flusher
+	{
+		LogOptions opts;
+		opts.maxmemory = 1024;
+		opts.blockonfull = true;
+		opts.syncinterval = std::chrono::milliseconds(1);
+		Logger lg(std::string(tmpdir) + "/bot", opts);
+		for (unsigned i = 0; i < 20; i++)
+			lg.log("big " + std::to_string(i) + " " + std::string(LOG_RING_SIZE, '#'));
+		std::this_thread::sleep_for(std::chrono::milliseconds(300));
+		LogStats st = lg.getStats();
+		assert(st.dropped == 0 && st.blocked > 0 && st.writeerrors == 0);
+		assert(st.flushes > 0 && st.maxflushns > 0 && st.avgFlushNs() > 0);
+		assert(st.syncs > 0 && st.backlog == 0);
+	}
+	std::string blocked = readfile(std::string(tmpdir) + "/bot_" + logts(true));
+	assert(blocked.size() == 20 * (LOG_RING_SIZE + 22) + 30);
+	unlink((std::string(tmpdir) + "/bot_" + logts(true)).c_str());
+
+	// Short writes: the rest of the shared buffer goes out before newer ring
+	// data of the same thread (file size limit, then lifted)
+	{
+		signal(SIGXFSZ, SIG_IGN);
+		struct rlimit prev, lim;
+		getrlimit(RLIMIT_FSIZE, &prev);
+		lim = prev;
+		lim.rlim_cur = 1000;
+		assert(!setrlimit(RLIMIT_FSIZE, &lim));
+		{
+			Logger lg(std::string(tmpdir) + "/short");
+			lg.log("big " + std::string(LOG_RING_SIZE, '#'));   // Shared buffer
+			std::this_thread::sleep_for(std::chrono::milliseconds(300));
+			assert(lg.getStats().writeerrors > 0);
+			for (unsigned i = 0; i < 10; i++)
+				lg.log("small " + std::to_string(i));        // Ring
+			assert(!setrlimit(RLIMIT_FSIZE, &prev));
+		}
+		std::string sfn = std::string(tmpdir) + "/short_" + logts(true);
+		std::istringstream iss(readfile(sfn));
+		std::vector<std::string> got;
+		for (std::string l; std::getline(iss, l); )
+			got.push_back(l.substr(16));
+		assert(got.size() == 11 && got[0] == "big " + std::string(LOG_RING_SIZE, '#'));
+		for (unsigned i = 0; i < 10; i++)
+			assert(got[i + 1] == "small " + std::to_string(i));
+		unlink(sfn.c_str());
+	}
+	rmdir(tmpdir);
+
+	// Levels, sampling and rate limiting
+	{
+		LogOptions opts;
+		opts.level = LOGLVL_INFO;
+		Logger lg(base, opts);
+		LOGD(lg, "debug {}", expensive());
+		assert(evaluated == 0);   // Arguments not evaluated
+		LOGI(lg, "info {}", expensive());
+		LOGE(lg, "error {} {}", expensive(), "str");
+		lg.setLevel(LOGLVL_ERROR);
+		LOGW(lg, "warn {}", expensive());
+		assert(evaluated == 2);
+		lg.setLevel(LOGLVL_DEBUG);
+		assert(lg.enabled(LOGLVL_DEBUG));
+
+		for (unsigned i = 0; i < 100; i++)
+			LOGL_EVERY_N(lg, LOGLVL_INFO, 10, "sampled {}", i);
+		for (unsigned i = 0; i < 100; i++)
+			LOGL_RATELIMIT(lg, LOGLVL_WARN, 5, "limited {}", i);
+		for (unsigned i = 0; i < 10; i++)
+			LOGL_EVERY_N(lg, LOGLVL_INFO, 0, "never {}", i);
+	}
+	data = readfile(fn);
+	assert(data.find(" I info 1\n") != std::string::npos);
+	assert(data.find(" E error 2 str\n") != std::string::npos);
+	assert(data.find("debug") == std::string::npos && data.find("warn") == std::string::npos);
+	assert(data.find("never") == std::string::npos);
+	unsigned sampled = 0, limited = 0;
+	for (size_t p = 0; (p = data.find(" I sampled ", p)) != std::string::npos; p++)
+		sampled++;
+	for (size_t p = 0; (p = data.find(" W limited ", p)) != std::string::npos; p++)
+		limited++;
+	assert(sampled == 10 && data.find(" I sampled 90\n") != std::string::npos);
+	assert(limited >= 5 && limited <= 10);   // Might cross a second boundary
+	unlink(fn.c_str());
+}
@@ -0,0 +1,71 @@
+
+#include "userdata.h"
+#include <cassert>
+
+int main() {
+	// Plain LRU cache, small enough to force evictions
+	lru11::Cache<unsigned, unsigned, std::mutex,
+		std::unordered_map<unsigned, std::list<lru11::KeyValuePair<unsigned, unsigned, true>>::iterator>,
+		lru11::AtomicStats> c(8, 2);
+
+	for (unsigned i = 0; i < 10; i++)
+		c.insert(i, i * 2);
+	c.insert(9, 99);
+	assert(c.size() == 8);
+
+	unsigned v;
+	assert(c.tryGet(9, v) && v == 99);
+	assert(!c.tryGet(0, v));
+	assert(!c.tryGet(1, v));
+
+	auto st = c.getStats();
+	assert(st.inserts == 10 && st.updates == 1);
+	assert(st.hits == 1 && st.misses == 2);
+	assert(st.evictions == 2 && st.prunes == 1);
+	assert(st.lockAcquisitions == 15 && st.lockContended == 0);
+	assert(st.hitRatio() > 0.3 && st.hitRatio() < 0.4);
+
+	// No stats by default
+	UserData<int> ud;
+	int d;
+	ud.updateUserData(1, 11);
+	assert(ud.getUserData(1, &d) && d == 11);
+	assert(ud.getStats().hits == 0);
+
+	// The insertion stamp only takes space in the nodes when stats are on
+	static_assert(sizeof(lru11::KeyValuePair<uint64_t, uint64_t>) == 16, "stamp without stats");
+	static_assert(sizeof(lru11::KeyValuePair<uint64_t, uint64_t, true>) > 16, "no stamp with stats");
+
+	// Aggregated per shard stats
+	UserData<int, lru11::AtomicStats> uds;
+	for (unsigned i = 0; i < SHARDF * 4; i++)
+		uds.updateUserData(i, i);
+	for (unsigned i = 0; i < SHARDF * 8; i++)
+		uds.getUserData(i, &d);
+	assert(uds.getStats().inserts == SHARDF * 4);
+	assert(uds.getStats().hits == SHARDF * 4 && uds.getStats().misses == SHARDF * 4);
+	assert(uds.getStats(0).hits == 4);
+
+	// Batch operations
+	UserData<std::string, lru11::AtomicStats> udb;
+	std::vector<std::pair<uint64_t, std::string>> entries;
+	for (uint64_t i = 0; i < 100; i++)
+		entries.emplace_back(i * 3, std::to_string(i));
+	udb.multiInsert(entries);
+	assert(udb.getStats().inserts == 100);
+	assert(udb.getStats().lockAcquisitions == SHARDF);
+
+	std::vector<uint64_t> keys = {0, 1, 3, 297, 300};
+	std::vector<std::pair<uint64_t, std::string>> found;
+	assert(udb.multiGet(keys, &found) == 3);
+	assert(found.size() == 3);
+	for (auto e : found)
+		assert(e.second == std::to_string(e.first / 3));
+	assert(udb.getStats().hits == 3 && udb.getStats().misses == 2);
+
+	// Batch and single calls see the same data
+	std::string s;
+	assert(udb.getUserData(150, &s) && s == "50");
+	assert(!udb.getUserData(151, &s));
+}
+
@@ -0,0 +1,126 @@
+
+// Microbenchmarks for the string helpers in util.cc
+
+#include "util.h"
+#include <chrono>
+#include <cstdio>
+#include <functional>
+
+// Previous (scalar, by value) implementations, as a baseline
+namespace scalar {
+	std::string mdescape(std::string s) {
+		std::string ret;
+		for (char c : s) {
+			if (c == '_' || c == '*' || c == '[' || c == '`')
+				ret += '\\';
+			ret += c;
+		}
+		return ret;
+	}
+
+	std::string htmlescape(std::string s) {
+		std::string ret; ret.reserve(s.size() + 64);
+		for (char c : s) {
+			if (c == '<')
+				ret += "&lt;";
+			else if (c == '>')
+				ret += "&gt;";
+			else if (c == '&')
+				ret += "&amp;";
+			else if (c == '"')
+				ret += "&quot;";
+			else
+				ret.push_back(c);
+		}
+		return ret;
+	}
+
+	std::string urienc(std::string s) {
+		static const char *hcharset = "0123456789abcdef";
+		std::string ret;
+		for (char c : s) {
+			if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'))
+				ret += c;
+			else {
+				ret.push_back('%');
+				ret.push_back(hcharset[(*(uint8_t*)&c) >> 4]);
+				ret.push_back(hcharset[(*(uint8_t*)&c) & 15]);
+			}
+		}
+		return ret;
+	}
+};
+
+static volatile size_t sink;
+
+// Runs fn over the input for ~200ms and prints throughput
+static void bench(const char *name, const std::string &in, std::function<size_t(const std::string&)> fn) {
+	auto start = std::chrono::steady_clock::now();
+	uint64_t iters = 0;
+	double elapsed;
+	do {
+		for (unsigned i = 0; i < 64; i++)
+			sink = fn(in);
+		iters += 64;
+		elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	} while (elapsed < 0.2);
+
+	printf("%-28s %6zu bytes  %9.1f ns/op  %8.1f MB/s\n", name, in.size(),
+	       elapsed * 1e9 / iters, in.size() * iters / elapsed / 1e6);
+}
+
+int main() {
+	std::string msg = "Found 3 results for your query, click on the buttons below to download them. "
+	                  "Size: 12.5MiB, format is <mp4> & the title is \"some_file_name\"";
+	std::string big;
+	while (big.size() < 64*1024)
+		big += msg + "\n";
+
+	for (auto in : {msg, big}) {
+		bench("mdescape (scalar)", in, [] (const std::string &s) { return scalar::mdescape(s).size(); });
+		bench("mdescape", in, [] (const std::string &s) { return mdescape(s).size(); });
+		bench("htmlescape (scalar)", in, [] (const std::string &s) { return scalar::htmlescape(s).size(); });
+		bench("htmlescape", in, [] (const std::string &s) { return htmlescape(s).size(); });
+		bench("urienc (scalar)", in, [] (const std::string &s) { return scalar::urienc(s).size(); });
+		bench("urienc", in, [] (const std::string &s) { return urienc(s).size(); });
+
+		std::string buf;
+		bench("htmlescape (append)", in, [&buf] (const std::string &s) {
+			buf.clear();
+			htmlescape(s, &buf);
+			return buf.size();
+		});
+	}
+
+	// Reply building
+	bench("reply (concat)", msg, [] (const std::string &s) {
+		return ("*Result:* " + mdescape(s) + " (" + hsize(s.size() * 1000) + ") /dl_" + to63(s.size() * 31337)).size();
+	});
+	bench("reply (MsgBuilder)", msg, [] (const std::string &s) {
+		return MsgBuilder::local().append("*Result:* ").mdescape(s).append(" (")
+			.hsize(s.size() * 1000).append(") /dl_").to63(s.size() * 31337).str().size();
+	});
+
+	// UTF-8 handling for long messages
+	std::string utxt;
+	while (utxt.size() < 64*1024)
+		utxt += msg + " \xd0\x9f\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82 \xf0\x9f\x98\x80\n";
+	bench("utf8valid", utxt, [] (const std::string &s) { return (size_t)utf8valid(s); });
+	bench("utf16len", utxt, [] (const std::string &s) { return utf16len(s); });
+	bench("msgsplit", utxt, [] (const std::string &s) {
+		std::vector<std::string_view> chunks;
+		msgsplit(s, &chunks);
+		return chunks.size();
+	});
+
+	// Callback data parsing
+	std::string cbdata = "dl:1a2b3c:mp4:720:0";
+	bench("strsplit", cbdata, [] (const std::string &s) { return strsplit(s, ':').size(); });
+	bench("StrSplit", cbdata, [] (const std::string &s) {
+		size_t n = 0;
+		for (auto tok : StrSplit(s, ':'))
+			n += tok.size();
+		return n;
+	});
+}
+
@@ -1,6 +1,21 @@
 
 #include "util.h"
 #include <cassert>
+#include <cstdlib>
+#include <cctype>
+
+// Plain scalar escaping, to check the vectorized versions against
+static std::string refescape(const std::string &s, const char *set, const char **repl) {
+	std::string ret;
+	for (char c : s) {
+		auto p = std::string(set).find(c);
+		if (p != std::string::npos)
+			ret += repl[p];
+		else
+			ret += c;
+	}
+	return ret;
+}
 
 int main() {
 	// Test split function
@@ -12,6 +27,31 @@ int main() {
 	assert(r2.size() == 3);
 	assert(r2[0] == "" && r2[1] == "b" && r2[2] == "");
 
+	// Lazy splitter, same results as strsplit by default
+	for (std::string in : {"a,b,c,d", ",b,", "", ",", "abc", "a,,b"}) {
+		std::vector<std::string> r;
+		for (auto tok : StrSplit(in, ','))
+			r.emplace_back(tok);
+		assert(r == strsplit(in, ','));
+	}
+
+	auto collect = [] (const StrSplit &sp) {
+		std::vector<std::string_view> ret(sp.begin(), sp.end());
+		return ret;
+	};
+	typedef std::vector<std::string_view> svv;
+	assert(collect(StrSplit(",a,,b,", ',', 0, true)) == svv({"a", "b"}));
+	assert(collect(StrSplit(",,,", ',', 0, true)).empty());
+	assert(collect(StrSplit("", ',', 0, true)).empty());
+	assert(collect(StrSplit("a,b,c,d", ',', 2)) == svv({"a", "b", "c,d"}));
+	assert(collect(StrSplit("a,,b,,c", ',', 1, true)) == svv({"a", "b,,c"}));
+	assert(collect(StrSplit("/cmd  arg1   arg2", ' ', 1, true)) == svv({"/cmd", "arg1   arg2"}));
+	assert(collect(StrSplit("a::b:c::", "::")) == svv({"a", "b:c", ""}));
+	assert(collect(StrSplit("::a::::b", "::", 0, true)) == svv({"a", "b"}));
+	assert(collect(StrSplit(std::string_view("a\0b", 3), std::string_view())) == svv({std::string_view("a\0b", 3)}));
+	assert(collect(StrSplit("", std::string_view(), 0, true)).empty());
+	assert(collect(StrSplit("a::b::c", "::", 1)) == svv({"a", "b::c"}));
+
 	// Trim
 	assert(trim("   ab cd ") == "ab cd");
 	assert(trim("abcd") == "abcd");
@@ -25,6 +65,22 @@ int main() {
 	assert(to63(0) == "0");
 	assert(from63("0") == 0);
 	assert(to63(0, 4) == "0000");
+	assert(from63(to63(~0ULL)) == ~0ULL && to63(~0ULL).size() == TO63_MAXLEN);
+
+	// Checked and fixed width base63
+	uint64_t n63;
+	assert(from63("0a_", &n63) && n63 == 10*63 + 62*63*63);
+	assert(!from63("0a-", &n63));
+	assert(from63(to63(~0ULL), &n63) && n63 == ~0ULL);
+	assert(!from63("___________", &n63));   // Overflows
+	char b63[TO63_MAXLEN * 3];
+	uint64_t ids[3] = {0, 123456789, ~0ULL}, ids2[3];
+	assert(to63(ids, 3, TO63_MAXLEN, b63) == &b63[sizeof(b63)]);
+	assert(std::string(b63, TO63_MAXLEN) == to63(0, TO63_MAXLEN));
+	assert(from63(b63, 3, TO63_MAXLEN, ids2));
+	assert(ids2[0] == ids[0] && ids2[1] == ids[1] && ids2[2] == ids[2]);
+	b63[TO63_MAXLEN + 1] = '!';
+	assert(!from63(b63, 3, TO63_MAXLEN, ids2));
 
 	// Some other str functions
 	assert(basename("/foo/bar/lol.pdf") == "lol.pdf");
@@ -37,6 +93,12 @@ int main() {
 	assert(fromhex("F0") == "\xf0");
 	assert(fromhex("41424344454647484142434445464748") == "ABCDEFGHABCDEFGH");
 	assert(fromhex("1") == "");
+	assert(fromhex("0g") == "" && fromhex("g0") == "" && fromhex("1 ") == "");
+	assert(fromhex("aAfF09") == "\xaa\xff\x09");
+	char hbuf[8];
+	assert(tohex("\x01\xfe", hbuf) == &hbuf[4] && std::string(hbuf, 4) == "01fe");
+	assert(fromhex("4142", hbuf) && hbuf[0] == 'A' && hbuf[1] == 'B');
+	assert(!fromhex("41x2", hbuf));
 
 	// Char escaping
 	assert(charescape("foo*bar", '$') == "foo*bar");
@@ -50,6 +112,49 @@ int main() {
 	assert(makeshort("hello there foo bar lol", 17) == "hello there...");
 	assert(makeshort("hello there foo bar lol", 18) == "hello there foo...");
 
+	assert(makeshort("\xd0\x9f\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82!!", 12) == "\xd0\x9f\xd1\x80\xd0\xb8\xd0\xb2...");
+
+	// UTF-8 validation and UTF-16 length
+	const std::string mixed = "Hola \xd0\x9f\xd1\x80\xd0\xb8 \xe4\xbd\xa0\xe5\xa5\xbd \xf0\x9f\x98\x80!";
+	assert(utf8valid("") && utf8valid("plain ascii text, long enough for SIMD"));
+	assert(utf8valid(mixed) && utf8valid(mixed + mixed + mixed));
+	assert(!utf8valid("\xc0\xaf") && !utf8valid("\xe0\x80\xaf") && !utf8valid("\xed\xa0\x80"));
+	assert(!utf8valid("\xf4\x90\x80\x80") && !utf8valid("abc\xe4\xbd") && !utf8valid("\x80"));
+	assert(!utf8valid(std::string(40, 'a') + "\xff"));
+	assert(utf16len("") == 0 && utf16len("abc") == 3);
+	assert(utf16len(mixed) == 5 + 3 + 1 + 2 + 1 + 2 + 1);
+	assert(utf16len(mixed + mixed + mixed) == 3 * utf16len(mixed));
+
+	// Message splitting
+	std::vector<std::string_view> chunks;
+	assert(msgsplit("hello world foo", &chunks, 11));
+	assert(chunks == std::vector<std::string_view>({"hello ", "world foo"}));
+	chunks.clear();
+	assert(msgsplit("abcdefghij", &chunks, 4));
+	assert(chunks == std::vector<std::string_view>({"abcd", "efgh", "ij"}));
+	chunks.clear();
+	assert(msgsplit("ab &amp; cd\\_ef", &chunks, 5) && chunks[1] == "&amp;");
+	chunks.clear();
+	assert(msgsplit("abcd&amp;", &chunks, 6) && chunks[0] == "abcd");
+	chunks.clear();
+	assert(msgsplit("abc\\_d", &chunks, 4) && chunks[0] == "abc");
+	chunks.clear();
+	assert(!msgsplit("abc\xff", &chunks));
+
+	for (unsigned lim : {2, 3, 7, 16, 33, 4096}) {
+		std::string txt;
+		for (unsigned i = 0; i < 200; i++)
+			txt += (i % 7) ? mixed : "\n" + std::string(i, 'x');
+		chunks.clear();
+		assert(msgsplit(txt, &chunks, lim));
+		std::string joined;
+		for (auto c : chunks) {
+			assert(c.size() && utf16len(c) <= lim && utf8valid(c));
+			joined += c;
+		}
+		assert(joined == txt);
+	}
+
 	// URL encoding
 	assert(urienc("https://foobar?a=123+456") == "https%3a%2f%2ffoobar%3fa%3d123%2b456");
 
@@ -60,6 +165,54 @@ int main() {
 	// HTML escape
 	assert(htmlescape("<a> foo & \"lol\"") == "&lt;a&gt; foo &amp; &quot;lol&quot;");
 
+	// Append variants
+	std::string out = "foo ";
+	htmlescape("<b>", &out);
+	mdescape("_x_", &out);
+	urienc("a b", &out);
+	charescape("$1", '$', &out);
+	assert(out == "foo &lt;b&gt;\\_x\\_a%20b\\$1");
+
+	// Random strings, covering all the SIMD block/tail combinations
+	const char *htmlrep[] = {"&lt;", "&gt;", "&amp;", "&quot;"};
+	const char *mdrep[] = {"\\_", "\\*", "\\[", "\\`"};
+	const char *crep[] = {"\\#"};
+	const char alphabet[] = "abcXYZ09 <>&\"_*[`#%/\x80\xff";
+	srand(1234);
+	for (unsigned i = 0; i < 4000; i++) {
+		std::string s;
+		unsigned l = rand() % 100;
+		bool dense = rand() & 1;
+		for (unsigned j = 0; j < l; j++)
+			s += dense ? alphabet[rand() % (sizeof(alphabet) - 1)] : 'a' + (rand() % 26);
+		assert(htmlescape(s) == refescape(s, "<>&\"", htmlrep));
+		assert(mdescape(s) == refescape(s, "_*[`", mdrep));
+		assert(charescape(s, '#') == refescape(s, "#", crep));
+
+		std::string uref;
+		for (char c : s)
+			uref += isalnum((uint8_t)c) ? std::string(1, c) : "%" + tohex(std::string(1, c));
+		assert(urienc(s) == uref);
+	}
+
+	// Message builder
+	MsgBuilder mb;
+	mb.append("File ").mdescape("a_b").append(' ').htmlescape("<x>").append(" ").hsize(1580);
+	mb.append(" ").num(-42).append(" ").unum(~0ULL).append(" ").to63(4000).append(" ").to63(1, 3);
+	mb.append(" ").hex("\x01\xff").append(" ").urienc("a b").append(" ").charescape("$1", '$');
+	assert(mb.view() == "File a\\_b &lt;x&gt; 1.5KiB -42 18446744073709551615 v01 100 01ff a%20b \\$1");
+	std::string longstr(1000, 'z');
+	for (unsigned i = 0; i < 10; i++)
+		mb.append(longstr);
+	assert(mb.size() == 10000 + 74 && mb.str().substr(74) == std::string(10000, 'z'));
+	mb.clear();
+	assert(mb.view().empty());
+
+	MsgBuilder &lb = MsgBuilder::local();
+	lb.append(longstr);
+	assert(MsgBuilder::local().size() == 0 && &MsgBuilder::local() == &lb);
+	assert(lb.num(0).num(-1).num(INT64_MIN).view() == "0-1-9223372036854775808");
+
 	// Size repr
 	assert(hsize(1) == "1B");
 	assert(hsize(1580) == "1.5KiB");
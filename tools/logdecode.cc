@@ -0,0 +1,50 @@
+
+// Decodes binary logs (see LogOptions::binary in logger.h) into text.
+// Usage: logdecode file.bin [file2.bin ...]
+// Files are read in fixed size blocks, so any size can be decoded.
+
+#include <cstdio>
+#include <fcntl.h>
+#include <iostream>
+#include "logger.h"
+
+#define DECODE_BLOCK   (256*1024)
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		std::cerr << "Usage: " << argv[0] << " logfile.bin [...]" << std::endl;
+		return 1;
+	}
+
+	int ret = 0;
+	std::string block(DECODE_BLOCK, 0), out;
+	for (int i = 1; i < argc; i++) {
+		int fd = open(argv[i], O_RDONLY);
+		if (fd < 0) {
+			std::cerr << argv[i] << ": cannot open file" << std::endl;
+			ret = 1;
+			continue;
+		}
+
+		LogDecoder dec;
+		ssize_t n;
+		bool ok = true;
+		while (ok && (n = read(fd, &block[0], block.size())) > 0) {
+			out.clear();
+			ok = dec.feed(std::string_view(block.data(), n), &out);
+			fwrite(out.data(), 1, out.size(), stdout);
+		}
+		if (!ok) {
+			std::cerr << argv[i] << ": not a valid binary log (offset " << dec.offset() << ")" << std::endl;
+			ret = 1;
+		}
+		else if (n < 0) {
+			std::cerr << argv[i] << ": read error" << std::endl;
+			ret = 1;
+		}
+		else if (dec.pending())
+			std::cerr << argv[i] << ": truncated record at offset " << dec.offset() << std::endl;
+		close(fd);
+	}
+	return ret;
+}
@@ -3,7 +3,11 @@
 #define _USER_DATA_STORAGE__H__
 
 #include <mutex>
+#include <array>
 #include <string>
+#include <vector>
+#include <utility>
+#include <functional>
 #include <stdint.h>
 
 #include "lrucache.h"
@@ -14,7 +18,8 @@
 #define MAX_ENT_SHARD  ( (UDATAMEM / SHARDF) / 128 )  // Assuming each entry is around 128 bytes (with overhead)
 
 // Class used to keep user data in memory
-template <typename T>
+// Use lru11::AtomicStats as Stats to collect per-shard cache statistics.
+template <typename T, typename Stats = lru11::NullStats>
 class UserData {
 public:
 	UserData() {
@@ -38,8 +43,62 @@ public:
 		unsigned sn = userid % SHARDF;
 		user_data_shards[sn]->insert(userid, data);
 	}
+
+	// Batch versions of the above, keys are grouped by shard so that each shard
+	// lock is only taken once. Found entries are appended to data grouped by
+	// shard (not in the userids order). Returns the number of entries found.
+	size_t multiGet(const std::vector<uint64_t> &userids, std::vector<std::pair<uint64_t, T>> *data) {
+		std::vector<uint64_t> sorted;
+		auto off = groupShards(userids, &sorted, [] (uint64_t uid) { return uid; });
+
+		size_t ret = 0;
+		for (unsigned sn = 0; sn < SHARDF; sn++)
+			if (off[sn] != off[sn+1])
+				ret += user_data_shards[sn]->multiGet(
+					sorted.begin() + off[sn], sorted.begin() + off[sn+1], *data);
+		return ret;
+	}
+	void multiInsert(const std::vector<std::pair<uint64_t, T>> &data) {
+		// Sort references, to avoid copying the user data around
+		std::vector<std::reference_wrapper<const std::pair<uint64_t, T>>> sorted;
+		auto off = groupShards(data, &sorted, [] (const std::pair<uint64_t, T> &e) { return e.first; });
+
+		for (unsigned sn = 0; sn < SHARDF; sn++)
+			if (off[sn] != off[sn+1])
+				user_data_shards[sn]->multiInsert(
+					sorted.begin() + off[sn], sorted.begin() + off[sn+1]);
+	}
+
+	// Stats for a given shard, or aggregated for all of them
+	lru11::CacheStats getStats(unsigned shard) const {
+		return user_data_shards[shard % SHARDF]->getStats();
+	}
+	lru11::CacheStats getStats() const {
+		lru11::CacheStats ret;
+		for (unsigned i = 0; i < SHARDF; i++)
+			ret += user_data_shards[i]->getStats();
+		return ret;
+	}
 private:
-	typedef lru11::Cache<uint64_t, T, std::mutex> CacheType;
+	// Stable partition of the input elements by shard (into out), returns
+	// the offsets where each shard starts (plus the end offset).
+	template <typename I, typename O, typename F>
+	static std::array<size_t, SHARDF+1> groupShards(const std::vector<I> &in, std::vector<O> *out, F keyf) {
+		std::array<size_t, SHARDF+1> off;
+		out->reserve(in.size());
+		for (unsigned sn = 0; sn < SHARDF; sn++) {
+			off[sn] = out->size();
+			for (const auto &e : in)
+				if (keyf(e) % SHARDF == sn)
+					out->push_back(e);
+		}
+		off[SHARDF] = out->size();
+		return off;
+	}
+
+	typedef lru11::Cache<uint64_t, T, std::mutex,
+		std::unordered_map<uint64_t, typename std::list<lru11::KeyValuePair<uint64_t, T, Stats::enabled>>::iterator>,
+		Stats> CacheType;
 	std::array<CacheType*, SHARDF> user_data_shards;
 };
 
@@ -1,59 +1,148 @@
 
 #include <string>
+#include <array>
 #include <algorithm>
 #include <stdint.h>
 #include <string.h>
 #include <assert.h>
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#define UTIL_SSE2
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define UTIL_AVX2       // Dispatched at runtime
+#define AVX2_FN __attribute__((target("avx2")))
+#endif
+#endif
+
 #include "util.h"
 
-static const char *cset = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_";
+static constexpr char cset[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_";
+static constexpr char hcharset[] = "0123456789abcdef";
+
+// Char to digit decoding tables, -1 for invalid chars
+static constexpr std::array<int8_t, 256> mkdectable(const char *charset, unsigned n) {
+	std::array<int8_t, 256> ret = {};
+	for (auto &e : ret)
+		e = -1;
+	for (unsigned i = 0; i < n; i++)
+		ret[(uint8_t)charset[i]] = i;
+	return ret;
+}
+static constexpr auto dec63 = mkdectable(cset, 63);
+static constexpr auto dechex = [] {
+	auto ret = mkdectable("0123456789abcdef", 16);
+	for (unsigned i = 0; i < 6; i++)
+		ret['A' + i] = 10 + i;
+	return ret;
+}();
 
 std::string to63(uint64_t n) {
-	std::string ret;
+	char tmp[TO63_MAXLEN];
+	unsigned l = 0;
 	do {
-		ret += cset[n % 63];
+		tmp[l++] = cset[n % 63];
 		n /= 63;
 	} while (n);
-	return ret;
+	return std::string(tmp, l);
 }
 
-std::string to63(uint64_t n, unsigned digits) {
-	std::string ret;
+char *to63(uint64_t n, unsigned digits, char *out) {
 	while (digits--) {
-		ret += cset[n % 63];
+		*out++ = cset[n % 63];
 		n /= 63;
 	}
+	return out;
+}
+
+std::string to63(uint64_t n, unsigned digits) {
+	std::string ret(digits, '\0');
+	to63(n, digits, &ret[0]);
 	return ret;
 }
 
-uint64_t from63(std::string s) {
+char *to63(const uint64_t *ns, size_t count, unsigned digits, char *out) {
+	for (size_t i = 0; i < count; i++)
+		out = to63(ns[i], digits, out);
+	return out;
+}
+
+uint64_t from63(std::string_view s) {
 	uint64_t ret = 0, mul = 1;
 	for (char c : s) {
-		const char *p = strchr(cset, c);
-		if (!p)
+		int d = dec63[(uint8_t)c];
+		if (d < 0)
 			break;
-		ret += (p - cset) * mul;
+		ret += d * mul;
 		mul *= 63;
 	}
 	return ret;
 }
 
-std::string hsize(uint64_t size) {
-	if (size < (1ULL<<10))
-		return std::to_string(size) + "B";
+bool from63(std::string_view s, uint64_t *n) {
+	// Horner's rule from the most significant digit, so overflow can be checked
+	uint64_t ret = 0;
+	for (auto it = s.rbegin(); it != s.rend(); ++it) {
+		int d = dec63[(uint8_t)*it];
+		if (d < 0 || __builtin_mul_overflow(ret, 63, &ret) || __builtin_add_overflow(ret, d, &ret))
+			return false;
+	}
+	*n = ret;
+	return true;
+}
+
+bool from63(const char *in, size_t count, unsigned digits, uint64_t *ns) {
+	for (size_t i = 0; i < count; i++, in += digits)
+		if (!from63(std::string_view(in, digits), &ns[i]))
+			return false;
+	return true;
+}
+
+// Writes the decimal representation of n, returns the end pointer
+static char *utoa(uint64_t n, char *out) {
+	char tmp[20];
+	unsigned l = 0;
+	do {
+		tmp[l++] = '0' + (n % 10);
+		n /= 10;
+	} while (n);
+	while (l)
+		*out++ = tmp[--l];
+	return out;
+}
+
+#define HSIZE_MAXLEN  16
+
+static char *hsize(uint64_t size, char *out) {
+	if (size < (1ULL<<10)) {
+		out = utoa(size, out);
+		*out++ = 'B';
+		return out;
+	}
 
 	const char *prefixes = "KMGTPE";
 	unsigned dec = 0, c = 0;
 	while (true) {
 		dec = (size & 1023);
 		size >>= 10;
-		if (size < (1ULL<<10))
-			return std::to_string(size) + "." + std::to_string(dec/103) + std::string(1, prefixes[c]) + "iB";
+		if (size < (1ULL<<10)) {
+			out = utoa(size, out);
+			*out++ = '.';
+			*out++ = '0' + dec/103;
+			*out++ = prefixes[c];
+			*out++ = 'i';
+			*out++ = 'B';
+			return out;
+		}
 		c++;
 	}
 }
 
+std::string hsize(uint64_t size) {
+	char tmp[HSIZE_MAXLEN];
+	return std::string(tmp, hsize(size, tmp) - tmp);
+}
+
 std::string trim(const std::string &str) {
 	auto first = str.find_first_not_of(' ');
 	if (std::string::npos == first)
@@ -69,55 +158,262 @@ std::string tr(std::string s) {
 	return output;
 }
 
-static const char *hcharset = "0123456789abcdef";
-std::string urienc(std::string s) {
-	std::string ret;
-	for (char c : s) {
-		if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'))
-			ret += c;
-		else {
-			ret.push_back('%');
-			ret.push_back(hcharset[(*(uint8_t*)&c) >> 4]);
-			ret.push_back(hcharset[(*(uint8_t*)&c) & 15]);
-		}
+// Escaping kernels: the input is scanned 16/32 bytes at a time looking for
+// bytes that need escaping, so that the output can be sized exactly first
+// and then filled by copying the runs in between escaped bytes.
+// Each escaper is a matcher (a small char set or the non-alphanumeric class)
+// plus a way to compute and emit the escaped sequence.
+
+struct CharSetMatch {
+	char set[4];   // Repeat chars to fill unused slots
+	bool match(uint8_t c) const {
+		return c == (uint8_t)set[0] || c == (uint8_t)set[1] ||
+		       c == (uint8_t)set[2] || c == (uint8_t)set[3];
 	}
+};
+
+struct NonAlnumMatch {
+	bool match(uint8_t c) const {
+		return !((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'));
+	}
+};
+
+#ifdef UTIL_SSE2
+static inline uint32_t escmask16(const CharSetMatch &m, const char *p) {
+	__m128i v = _mm_loadu_si128((const __m128i*)p);
+	__m128i r = _mm_or_si128(
+		_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(m.set[0])), _mm_cmpeq_epi8(v, _mm_set1_epi8(m.set[1]))),
+		_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(m.set[2])), _mm_cmpeq_epi8(v, _mm_set1_epi8(m.set[3]))));
+	return _mm_movemask_epi8(r);
+}
+
+// Unsigned range check: (x - lo) <= (hi - lo), using saturating subtraction
+static inline __m128i inrange16(__m128i v, char lo, char hi) {
+	__m128i t = _mm_sub_epi8(v, _mm_set1_epi8(lo));
+	return _mm_cmpeq_epi8(_mm_subs_epu8(t, _mm_set1_epi8(hi - lo)), _mm_setzero_si128());
+}
+
+static inline uint32_t escmask16(const NonAlnumMatch &, const char *p) {
+	__m128i v = _mm_loadu_si128((const __m128i*)p);
+	// OR-ing 0x20 folds uppercase into lowercase and nothing else into a-z
+	__m128i alnum = _mm_or_si128(inrange16(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 'z'),
+	                             inrange16(v, '0', '9'));
+	return ~_mm_movemask_epi8(alnum) & 0xFFFF;
+}
+#endif
+
+#ifdef UTIL_AVX2
+AVX2_FN static inline uint32_t escmask32(const CharSetMatch &m, const char *p) {
+	__m256i v = _mm256_loadu_si256((const __m256i*)p);
+	__m256i r = _mm256_or_si256(
+		_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(m.set[0])), _mm256_cmpeq_epi8(v, _mm256_set1_epi8(m.set[1]))),
+		_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(m.set[2])), _mm256_cmpeq_epi8(v, _mm256_set1_epi8(m.set[3]))));
+	return _mm256_movemask_epi8(r);
+}
+
+AVX2_FN static inline __m256i inrange32(__m256i v, char lo, char hi) {
+	__m256i t = _mm256_sub_epi8(v, _mm256_set1_epi8(lo));
+	return _mm256_cmpeq_epi8(_mm256_subs_epu8(t, _mm256_set1_epi8(hi - lo)), _mm256_setzero_si256());
+}
+
+AVX2_FN static inline uint32_t escmask32(const NonAlnumMatch &, const char *p) {
+	__m256i v = _mm256_loadu_si256((const __m256i*)p);
+	__m256i alnum = _mm256_or_si256(inrange32(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), 'a', 'z'),
+	                                inrange32(v, '0', '9'));
+	return ~(uint32_t)_mm256_movemask_epi8(alnum);
+}
+
+static bool has_avx2() {
+	static const bool ret = [] {
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2") != 0;
+	}();
 	return ret;
 }
+#endif
 
-std::string mdescape(std::string s) {
-	std::string ret;
-	for (char c : s) {
-		if (c == '_' || c == '*' || c == '[' || c == '`')
-			ret += '\\';
-		ret += c;
-	}
+// Returns the number of extra bytes the escaped output needs
+template <class E>
+static size_t esc_extra_scalar(const E &e, const char *s, size_t i, size_t n) {
+	size_t ret = 0;
+	for (; i < n; i++)
+		if (e.match(s[i]))
+			ret += e.extra(s[i]);
 	return ret;
 }
 
-std::string htmlescape(std::string s) {
-	std::string ret; ret.reserve(s.size() + 64);
-	for (char c : s) {
-		if (c == '<')
-			ret += "&lt;";
-		else if (c == '>')
-			ret += "&gt;";
-		else if (c == '&')
-			ret += "&amp;";
-		else if (c == '"')
-			ret += "&quot;";
+template <class E>
+static inline size_t esc_extra_mask(const E &e, const char *s, uint32_t mask) {
+	if (E::fixed_extra)
+		return __builtin_popcount(mask) * E::fixed_extra;
+	size_t ret = 0;
+	for (; mask; mask &= mask - 1)
+		ret += e.extra(s[__builtin_ctz(mask)]);
+	return ret;
+}
+
+template <class E>
+static char *esc_write_scalar(const E &e, std::string_view s, size_t i, char *o) {
+	for (; i < s.size(); i++) {
+		if (e.match(s[i]))
+			o = e.emit(o, s[i]);
 		else
-			ret.push_back(c);
+			*o++ = s[i];
+	}
+	return o;
+}
+
+// Escapes a block of w bytes, given the mask of bytes to escape
+template <class E>
+static inline char *esc_block(const E &e, const char *s, unsigned w, uint32_t mask, char *o) {
+	if (!mask) {
+		memcpy(o, s, w);
+		return o + w;
+	}
+	unsigned i = 0;
+	for (; mask; mask &= mask - 1) {
+		unsigned j = __builtin_ctz(mask);
+		memcpy(o, &s[i], j - i);
+		o = e.emit(o + j - i, s[j]);
+		i = j + 1;
+	}
+	memcpy(o, &s[i], w - i);
+	return o + w - i;
+}
+
+#ifdef UTIL_AVX2
+template <class E>
+AVX2_FN static size_t esc_extra_avx2(const E &e, const char *s, size_t n) {
+	size_t ret = 0, i = 0;
+	for (; i + 32 <= n; i += 32)
+		ret += esc_extra_mask(e, &s[i], escmask32(e, &s[i]));
+	return ret + esc_extra_scalar(e, s, i, n);
+}
+
+template <class E>
+AVX2_FN static char *esc_write_avx2(const E &e, std::string_view s, char *o) {
+	size_t i = 0;
+	for (; i + 32 <= s.size(); i += 32)
+		o = esc_block(e, &s[i], 32, escmask32(e, &s[i]), o);
+	return esc_write_scalar(e, s, i, o);
+}
+#endif
+
+template <class E>
+static size_t esc_extra(const E &e, const char *s, size_t n) {
+	size_t i = 0, ret = 0;
+	#ifdef UTIL_AVX2
+	if (has_avx2())
+		return esc_extra_avx2(e, s, n);
+	#endif
+	#ifdef UTIL_SSE2
+	for (; i + 16 <= n; i += 16)
+		ret += esc_extra_mask(e, &s[i], escmask16(e, &s[i]));
+	#endif
+	return ret + esc_extra_scalar(e, s, i, n);
+}
+
+// Writes the escaped string to o (must have room for it), returns the end
+template <class E>
+static char *esc_write(const E &e, std::string_view s, char *o) {
+	size_t i = 0;
+	#ifdef UTIL_AVX2
+	if (has_avx2())
+		return esc_write_avx2(e, s, o);
+	#endif
+	#ifdef UTIL_SSE2
+	for (; i + 16 <= s.size(); i += 16)
+		o = esc_block(e, &s[i], 16, escmask16(e, &s[i]), o);
+	#endif
+	return esc_write_scalar(e, s, i, o);
+}
+
+template <class E>
+static void esc_append(const E &e, std::string_view s, std::string *out) {
+	size_t extra = esc_extra(e, s.data(), s.size());
+	size_t off = out->size();
+	out->resize(off + s.size() + extra);
+	if (!extra)
+		memcpy(&(*out)[off], s.data(), s.size());
+	else
+		esc_write(e, s, &(*out)[off]);
+}
+
+struct UriEscaper : NonAlnumMatch {
+	static constexpr unsigned fixed_extra = 2;
+	unsigned extra(uint8_t) const { return 2; }
+	char *emit(char *o, uint8_t c) const {
+		*o++ = '%';
+		*o++ = hcharset[c >> 4];
+		*o++ = hcharset[c & 15];
+		return o;
 	}
+};
+
+struct CharEscaper : CharSetMatch {
+	static constexpr unsigned fixed_extra = 1;
+	CharEscaper(char a, char b, char c, char d) : CharSetMatch{{a, b, c, d}} {}
+	unsigned extra(uint8_t) const { return 1; }
+	char *emit(char *o, uint8_t c) const {
+		*o++ = '\\';
+		*o++ = c;
+		return o;
+	}
+};
+
+struct HtmlEscaper : CharSetMatch {
+	static constexpr unsigned fixed_extra = 0;
+	HtmlEscaper() : CharSetMatch{{'<', '>', '&', '"'}} {}
+	unsigned extra(uint8_t c) const {
+		return c == '&' ? 4 : c == '"' ? 5 : 3;
+	}
+	char *emit(char *o, uint8_t c) const {
+		const char *e = c == '<' ? "&lt;" : c == '>' ? "&gt;" : c == '&' ? "&amp;" : "&quot;";
+		size_t l = extra(c) + 1;
+		memcpy(o, e, l);
+		return o + l;
+	}
+};
+
+static const CharEscaper mdescaper('_', '*', '[', '`');
+
+void urienc(std::string_view s, std::string *out) {
+	esc_append(UriEscaper(), s, out);
+}
+
+std::string urienc(std::string_view s) {
+	std::string ret;
+	urienc(s, &ret);
+	return ret;
+}
+
+void mdescape(std::string_view s, std::string *out) {
+	esc_append(mdescaper, s, out);
+}
+
+std::string mdescape(std::string_view s) {
+	std::string ret;
+	mdescape(s, &ret);
 	return ret;
 }
 
-std::string charescape(std::string s, char r) {
+void htmlescape(std::string_view s, std::string *out) {
+	esc_append(HtmlEscaper(), s, out);
+}
+
+std::string htmlescape(std::string_view s) {
 	std::string ret;
-	for (char c : s) {
-		if (c == r)
-			ret += '\\';
-		ret += c;
-	}
+	htmlescape(s, &ret);
+	return ret;
+}
+
+void charescape(std::string_view s, char r, std::string *out) {
+	esc_append(CharEscaper(r, r, r, r), s, out);
+}
+
+std::string charescape(std::string_view s, char r) {
+	std::string ret;
+	charescape(s, r, &ret);
 	return ret;
 }
 
@@ -135,41 +431,51 @@ std::string makeshort(std::string msg, unsigned maxlen) {
 			auto pos = msg.find_last_of(' ');
 			if (pos != std::string::npos)
 				msg.resize(pos);
-			else
-				msg.resize(maxlen - 3);
+			else {
+				// Do not cut UTF-8 sequences in half
+				unsigned l = maxlen - 3;
+				while (l && (msg[l] & 0xC0) == 0x80)
+					l--;
+				msg.resize(l);
+			}
 		}
 		return msg + "...";
 	}
 	return msg;
 }
 
-std::string tohex(const std::string & buf) {
-	std::string ret(buf.size() * 2, '\0');
-	static const char *hcharset = "0123456789abcdef";
-	for (unsigned i = 0; i < buf.size(); i++) {
-		uint8_t c = buf[i];
-		ret[i*2+0] = hcharset[c >> 4];
-		ret[i*2+1] = hcharset[c & 15];
+char *tohex(std::string_view buf, char *out) {
+	for (uint8_t c : buf) {
+		*out++ = hcharset[c >> 4];
+		*out++ = hcharset[c & 15];
 	}
-	return ret;
+	return out;
 }
 
-static inline int hdec(char c) {
-	if (c >= '0' && c <= '9')
-		return c - '0';
-	if (c >= 'a' && c <= 'f')
-		return c - 'a' + 10;
-	if (c >= 'A' && c <= 'F')
-		return c - 'A' + 10;
-	return -1;
+std::string tohex(std::string_view buf) {
+	std::string ret(buf.size() * 2, '\0');
+	tohex(buf, &ret[0]);
+	return ret;
 }
 
-std::string fromhex(const std::string &h) {
+bool fromhex(std::string_view h, char *out) {
 	if (h.size() & 1)
-		return {};
+		return false;
+	// Accumulate the digits so the error check is out of the loop
+	// (invalid ones are -1, combined as unsigned to avoid shifting negatives)
+	int bad = 0;
+	for (size_t i = 0; i < h.size(); i += 2) {
+		int hi = dechex[(uint8_t)h[i]], lo = dechex[(uint8_t)h[i+1]];
+		bad |= hi | lo;
+		*out++ = (char)(((unsigned)hi << 4) | (unsigned)lo);
+	}
+	return bad >= 0;
+}
+
+std::string fromhex(std::string_view h) {
 	std::string ret(h.size() >> 1, '\0');
-	for (unsigned i = 0; i < ret.size(); i++)
-		ret[i] = (hdec(h[i*2+0]) << 4) | hdec(h[i*2+1]);
+	if (!fromhex(h, &ret[0]))
+		return {};
 	return ret;
 }
 
@@ -184,3 +490,223 @@ std::vector<std::string> strsplit(const std::string &s, char c) {
 	return ret;
 }
 
+
+// Returns the length of the UTF-8 sequence at p, or zero if invalid
+static inline unsigned utf8seq(const uint8_t *p, size_t avail) {
+	uint8_t c = p[0];
+	if (c < 0x80)
+		return 1;
+	auto cont = [] (uint8_t b) { return (b & 0xC0) == 0x80; };
+	if (c >= 0xC2 && c <= 0xDF)
+		return avail >= 2 && cont(p[1]) ? 2 : 0;
+	if (c >= 0xE0 && c <= 0xEF) {
+		if (avail < 3 || !cont(p[1]) || !cont(p[2]))
+			return 0;
+		if ((c == 0xE0 && p[1] < 0xA0) || (c == 0xED && p[1] > 0x9F))
+			return 0;   // Overlong and surrogates
+		return 3;
+	}
+	if (c >= 0xF0 && c <= 0xF4) {
+		if (avail < 4 || !cont(p[1]) || !cont(p[2]) || !cont(p[3]))
+			return 0;
+		if ((c == 0xF0 && p[1] < 0x90) || (c == 0xF4 && p[1] > 0x8F))
+			return 0;   // Overlong and over U+10FFFF
+		return 4;
+	}
+	return 0;
+}
+
+#ifdef UTIL_SSE2
+static inline bool isascii16(const char *p) {
+	return !_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)p));
+}
+#endif
+
+bool utf8valid(std::string_view s) {
+	const uint8_t *p = (const uint8_t*)s.data();
+	size_t i = 0, n = s.size();
+	while (i < n) {
+		#ifdef UTIL_SSE2
+		if (i + 16 <= n && isascii16(&s[i])) {
+			i += 16;
+			continue;
+		}
+		#endif
+		unsigned l = utf8seq(&p[i], n - i);
+		if (!l)
+			return false;
+		i += l;
+	}
+	return true;
+}
+
+size_t utf16len(std::string_view s) {
+	// One unit per non-continuation byte, plus one per 4-byte sequence lead
+	size_t i = 0, ret = 0;
+	#ifdef UTIL_SSE2
+	for (; i + 16 <= s.size(); i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)&s[i]);
+		__m128i cont = _mm_cmplt_epi8(v, _mm_set1_epi8(-64));        // 0x80-0xBF
+		__m128i lead4 = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(-17)),
+		                              _mm_cmplt_epi8(v, _mm_setzero_si128()));  // 0xF0-0xFF
+		ret += 16 - __builtin_popcount(_mm_movemask_epi8(cont)) +
+		       __builtin_popcount(_mm_movemask_epi8(lead4));
+	}
+	#endif
+	for (; i < s.size(); i++) {
+		uint8_t c = s[i];
+		ret += ((c & 0xC0) != 0x80) + (c >= 0xF0);
+	}
+	return ret;
+}
+
+// Moves a cut point backwards so that it doesn't split an escape sequence
+// (a Markdown backslash escape or an HTML entity)
+static size_t safecut(std::string_view s, size_t start, size_t cut) {
+	for (size_t i = cut; i > start && cut - i < 10; i--) {
+		char c = s[i-1];
+		if (c == '&')
+			cut = i - 1;
+		if (c == '&' || c == ';' || c == ' ')
+			break;
+	}
+	if (cut > start + 1 && s[cut-1] == '\\')
+		cut--;
+	return cut > start ? cut : start;
+}
+
+bool msgsplit(std::string_view s, std::vector<std::string_view> *chunks, size_t maxunits) {
+	const uint8_t *p = (const uint8_t*)s.data();
+	size_t n = s.size(), i = 0;
+	size_t start = 0, units = 0;     // Current chunk
+	size_t brk = 0, brkunits = 0;    // Last word break in the chunk (after a space)
+
+	while (i < n) {
+		#ifdef UTIL_SSE2
+		// ASCII blocks that fit in the current chunk, just track word breaks
+		if (i + 16 <= n && units + 16 <= maxunits && isascii16(&s[i])) {
+			__m128i v = _mm_loadu_si128((const __m128i*)&s[i]);
+			unsigned ws = _mm_movemask_epi8(_mm_or_si128(
+				_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))));
+			if (ws) {
+				unsigned last = 31 - __builtin_clz(ws) + 1;
+				brk = i + last;
+				brkunits = units + last;
+			}
+			units += 16;
+			i += 16;
+			continue;
+		}
+		#endif
+		unsigned l = utf8seq(&p[i], n - i);
+		if (!l)
+			return false;
+		unsigned u = l == 4 ? 2 : 1;
+
+		while (units && units + u > maxunits) {
+			// Cut at the last word break, or right here if there's none
+			size_t cut = brk > start ? brk : safecut(s, start, i);
+			if (cut == start)
+				cut = i;
+			chunks->push_back(s.substr(start, cut - start));
+			units = cut == brk ? units - brkunits : utf16len(s.substr(cut, i - cut));
+			start = brk = cut;
+		}
+
+		if (s[i] == ' ' || s[i] == '\n') {
+			brk = i + 1;
+			brkunits = units + 1;
+		}
+		units += u;
+		i += l;
+	}
+	if (start < n)
+		chunks->push_back(s.substr(start));
+	return true;
+}
+
+MsgBuilder &MsgBuilder::local() {
+	static thread_local MsgBuilder buf;
+	buf.clear();
+	return buf;
+}
+
+char *MsgBuilder::grow(size_t n) {
+	size_t newcap = std::max(cap * 2, len + n);
+	std::unique_ptr<char[]> nbuf(new char[newcap]);
+	memcpy(nbuf.get(), ptr, len);
+	heap = std::move(nbuf);
+	ptr = heap.get();
+	cap = newcap;
+	return &ptr[len];
+}
+
+MsgBuilder &MsgBuilder::append(std::string_view s) {
+	memcpy(reserve(s.size()), s.data(), s.size());
+	len += s.size();
+	return *this;
+}
+
+MsgBuilder &MsgBuilder::num(int64_t n) {
+	char *p = reserve(21);
+	if (n < 0) {
+		*p++ = '-';
+		commit(utoa(-(uint64_t)n, p));
+	}
+	else
+		commit(utoa(n, p));
+	return *this;
+}
+
+MsgBuilder &MsgBuilder::unum(uint64_t n) {
+	commit(utoa(n, reserve(20)));
+	return *this;
+}
+
+MsgBuilder &MsgBuilder::hsize(uint64_t n) {
+	commit(::hsize(n, reserve(HSIZE_MAXLEN)));
+	return *this;
+}
+
+MsgBuilder &MsgBuilder::to63(uint64_t n) {
+	char tmp[TO63_MAXLEN];
+	unsigned l = 0;
+	do {
+		tmp[l++] = cset[n % 63];
+		n /= 63;
+	} while (n);
+	return append(std::string_view(tmp, l));
+}
+
+MsgBuilder &MsgBuilder::to63(uint64_t n, unsigned digits) {
+	commit(::to63(n, digits, reserve(digits)));
+	return *this;
+}
+
+MsgBuilder &MsgBuilder::hex(std::string_view s) {
+	commit(::tohex(s, reserve(s.size() * 2)));
+	return *this;
+}
+
+template <class E>
+static MsgBuilder &esc_append(const E &e, std::string_view s, MsgBuilder *b) {
+	size_t extra = esc_extra(e, s.data(), s.size());
+	b->commit(esc_write(e, s, b->reserve(s.size() + extra)));
+	return *b;
+}
+
+MsgBuilder &MsgBuilder::urienc(std::string_view s) {
+	return esc_append(UriEscaper(), s, this);
+}
+
+MsgBuilder &MsgBuilder::mdescape(std::string_view s) {
+	return esc_append(mdescaper, s, this);
+}
+
+MsgBuilder &MsgBuilder::htmlescape(std::string_view s) {
+	return esc_append(HtmlEscaper(), s, this);
+}
+
+MsgBuilder &MsgBuilder::charescape(std::string_view s, char r) {
+	return esc_append(CharEscaper(r, r, r, r), s, this);
+}
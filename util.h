@@ -4,7 +4,10 @@
 
 #include <stdint.h>
 #include <string>
+#include <string_view>
 #include <vector>
+#include <memory>
+#include <iterator>
 
 // Creates a human-readable file size from byte count
 std::string hsize(uint64_t size);
@@ -12,10 +15,115 @@ std::string hsize(uint64_t size);
 // Splits a string into chunks
 std::vector<std::string> strsplit(const std::string &s, char c);
 
-// Convert to and from base63
+// Lazy splitter that produces string_views into the input (no allocations),
+// the input must outlive it. Delimiter can be a char or a string.
+// maxsplit limits the number of splits (0 is unlimited), the last token holds
+// the rest of the string. skipempty drops empty tokens (ie. repeated, leading
+// and trailing delimiters), these do not count towards maxsplit.
+// Usage: for (std::string_view tok : StrSplit(s, ',')) { ... }
+class StrSplit {
+public:
+	class iterator {
+	public:
+		typedef std::forward_iterator_tag iterator_category;
+		typedef std::string_view value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef const std::string_view* pointer;
+		typedef const std::string_view& reference;
+
+		iterator() : end(true) {}
+		iterator(const StrSplit *sp)
+		 : rest(sp->s), delim(sp->delim), dchar(sp->dchar), bychar(sp->bychar), left(sp->maxsplit),
+		   skipempty(sp->skipempty), last(false), end(false) {
+			if (!left)
+				left = ~0U;
+			advance();
+		}
+
+		reference operator*() const { return tok; }
+		pointer operator->() const { return &tok; }
+		iterator& operator++() { advance(); return *this; }
+		iterator operator++(int) { iterator r = *this; advance(); return r; }
+
+		bool operator==(const iterator &o) const {
+			return end == o.end && (end || tok.data() == o.tok.data());
+		}
+		bool operator!=(const iterator &o) const { return !(*this == o); }
+
+	private:
+		// An empty string delimiter never matches (yields the whole string)
+		size_t dlen() const { return bychar ? 1 : delim.size(); }
+		size_t find() const {
+			if (bychar)
+				return rest.find(dchar);
+			return delim.empty() ? std::string_view::npos : rest.find(delim);
+		}
+		bool startsdelim() const {
+			if (bychar)
+				return !rest.empty() && rest[0] == dchar;
+			return !delim.empty() && rest.substr(0, delim.size()) == delim;
+		}
+
+		void advance() {
+			if (last) {
+				end = true;
+				return;
+			}
+			if (skipempty) {
+				while (startsdelim())
+					rest.remove_prefix(dlen());
+				if (rest.empty()) {
+					end = true;
+					return;
+				}
+			}
+			size_t p = left ? find() : std::string_view::npos;
+			if (p == std::string_view::npos) {
+				tok = rest;
+				last = true;
+			}
+			else {
+				tok = rest.substr(0, p);
+				rest.remove_prefix(p + dlen());
+				left--;
+			}
+		}
+
+		std::string_view rest, tok, delim;
+		char dchar;
+		bool bychar;
+		unsigned left;
+		bool skipempty, last, end;
+	};
+
+	StrSplit(std::string_view s, char c, unsigned maxsplit = 0, bool skipempty = false)
+	 : s(s), dchar(c), bychar(true), maxsplit(maxsplit), skipempty(skipempty) {}
+	StrSplit(std::string_view s, std::string_view delim, unsigned maxsplit = 0, bool skipempty = false)
+	 : s(s), delim(delim), dchar(0), bychar(false), maxsplit(maxsplit), skipempty(skipempty) {}
+
+	iterator begin() const { return iterator(this); }
+	iterator end() const { return iterator(); }
+
+private:
+	std::string_view s, delim;
+	char dchar;
+	bool bychar;
+	unsigned maxsplit;
+	bool skipempty;
+};
+
+// Convert to and from base63 (least significant digit first)
+#define TO63_MAXLEN  11    // Max digits for an uint64_t
 std::string to63(uint64_t n);
 std::string to63(uint64_t n, unsigned digits);
-uint64_t from63(std::string s);
+uint64_t from63(std::string_view s);   // Stops at the first invalid char
+// Writes exactly digits chars (no terminator) and returns the end pointer
+char *to63(uint64_t n, unsigned digits, char *out);
+// Checked decoding, returns false on invalid chars or overflow
+bool from63(std::string_view s, uint64_t *n);
+// Batch versions, for arrays of fixed width (digits chars) numbers
+char *to63(const uint64_t *ns, size_t count, unsigned digits, char *out);
+bool from63(const char *in, size_t count, unsigned digits, uint64_t *ns);
 
 // Trims spaces and stuff from both sides
 std::string trim(const std::string &str);
@@ -23,14 +131,21 @@ std::string trim(const std::string &str);
 // Remove repeated spaces
 std::string tr(std::string s);
 
+// Escaping functions, they have SIMD implementations (SSE2/AVX2).
+// The overloads with an output argument append to it instead.
+
 // URI-encodes a string
-std::string urienc(std::string s);
+std::string urienc(std::string_view s);
+void urienc(std::string_view s, std::string *out);
 
 // Escapes Markdown strings, telegram is a bit picky :)
-std::string mdescape(std::string s);
-std::string charescape(std::string s, char r);
+std::string mdescape(std::string_view s);
+void mdescape(std::string_view s, std::string *out);
+std::string charescape(std::string_view s, char r);
+void charescape(std::string_view s, char r, std::string *out);
 // HTML escaping
-std::string htmlescape(std::string s);
+std::string htmlescape(std::string_view s);
+void htmlescape(std::string_view s, std::string *out);
 
 // Get the filename given a path
 std::string basename(std::string fn);
@@ -39,9 +154,71 @@ std::string basename(std::string fn);
 // TODO: Make it work in non-indoeuropean languages perhaps?
 std::string makeshort(std::string msg, unsigned maxlen);
 
-// Hex conversion functions
-std::string tohex(const std::string & buf);
-std::string fromhex(const std::string &h);
+// UTF-8 helpers. Telegram limits are counted in UTF-16 code units.
+#define TG_MSG_MAXLEN   4096
+bool utf8valid(std::string_view s);
+size_t utf16len(std::string_view s);     // Assumes valid UTF-8
+// Validates and splits a message into chunks of at most maxunits UTF-16
+// units, in one pass. Cuts after the last space/newline of the chunk if any,
+// otherwise at a codepoint boundary avoiding already escaped sequences.
+// Chunks point into the input. Returns false on invalid UTF-8.
+bool msgsplit(std::string_view s, std::vector<std::string_view> *chunks,
+              size_t maxunits = TG_MSG_MAXLEN);
+
+// Appendable buffer to build messages without temporary strings.
+// The first MSGBUF_INLINE bytes are stored inline, it grows on the heap after
+// that. MsgBuilder::local() returns a cleared thread-local instance that keeps
+// its heap buffer across messages (do not nest its usage!).
+// Usage: MsgBuilder::local().append("File ").mdescape(fn).append(" (").hsize(sz).append(")").str();
+#define MSGBUF_INLINE  256
+class MsgBuilder {
+public:
+	MsgBuilder() : ptr(sbuf), len(0), cap(sizeof(sbuf)) {}
+	MsgBuilder(const MsgBuilder&) = delete;
+	MsgBuilder& operator=(const MsgBuilder&) = delete;
+
+	static MsgBuilder &local();
+
+	MsgBuilder &append(std::string_view s);
+	MsgBuilder &append(char c) { *reserve(1) = c; len++; return *this; }
+	MsgBuilder &num(int64_t n);
+	MsgBuilder &unum(uint64_t n);
+	MsgBuilder &hsize(uint64_t n);
+	MsgBuilder &to63(uint64_t n);
+	MsgBuilder &to63(uint64_t n, unsigned digits);
+	MsgBuilder &hex(std::string_view s);
+	MsgBuilder &urienc(std::string_view s);
+	MsgBuilder &mdescape(std::string_view s);
+	MsgBuilder &htmlescape(std::string_view s);
+	MsgBuilder &charescape(std::string_view s, char r);
+
+	std::string_view view() const { return std::string_view(ptr, len); }
+	std::string str() const { return std::string(ptr, len); }
+	const char *data() const { return ptr; }
+	size_t size() const { return len; }
+	void clear() { len = 0; }
+
+	// Low level access for custom appenders: reserve() makes room for n more
+	// bytes and returns the write position, commit() sets the new end.
+	char *reserve(size_t n) { return len + n <= cap ? &ptr[len] : grow(n); }
+	void commit(char *end) { len = end - ptr; }
+
+private:
+	char *grow(size_t n);
+
+	char sbuf[MSGBUF_INLINE];
+	std::unique_ptr<char[]> heap;
+	char *ptr;
+	size_t len, cap;
+};
+
+// Hex conversion functions, fromhex returns empty on invalid input
+std::string tohex(std::string_view buf);
+std::string fromhex(std::string_view h);
+// Buffer versions: tohex writes 2*size chars and returns the end pointer,
+// fromhex writes size/2 bytes and returns false on invalid input
+char *tohex(std::string_view buf, char *out);
+bool fromhex(std::string_view h, char *out);
 
 #endif
 